@@ -2,7 +2,6 @@
 #include <EEPROM.h>
 #include <LiquidCrystal.h>
 #include <FlexiTimer2.h>
-#include <Keypad.h>
 #include <Time.h>
 #include "microfs.h"
 #include "uxmgr.h"
@@ -22,13 +21,20 @@ void setup() {
 }
 
 void loop() {
+  // time loop() and its sections when UXMGR_STATS is set
+  UXMGR_LOOP();
   // poll the flame sensor
-  poll_flame_sensor();
+  UXMGR_TIME(0, "flame sensor", poll_flame_sensor());
   // fetch the temperature sensor
-  poll_temperature();
+  UXMGR_TIME(1, "temperature", poll_temperature());
   // scan the keypad
-  poll_keypad();
-  // draw the UI
-  uxmgr::get().draw();
+  UXMGR_TIME(2, "keypad", poll_keypad());
+  // draw the UI and send what changed to the LCD
+  UXMGR_TIME(3, "display", update_display());
+  // defragment the file system a few bytes at a time
+  UXMGR_TIME(4, "fs compact", fs.compact());
+  // check the file system a file at a time
+  UXMGR_TIME(5, "fs check", fs.fsck());
+  // send/receive file system exports over Serial
+  UXMGR_TIME(6, "fs serial", poll_fs());
 }
-
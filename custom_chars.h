@@ -79,60 +79,61 @@ PROGMEM byte logo13[] = {
   B11111
 };
 
-#define lcd_char_invert(name) { \
-  name[0] = (~name[0]) & B11111; \
-  name[1] = (~name[1]) & B11111; \
-  name[2] = (~name[2]) & B11111; \
-  name[3] = (~name[3]) & B11111; \
-  name[4] = (~name[4]) & B11111; \
-  name[5] = (~name[5]) & B11111; \
-  name[6] = (~name[6]) & B11111; \
-  name[7] = (~name[7]) & B11111; \
-}
+// the inverted glyph (8 rows of 5 pixels), computed by the compiler
+#define lcd_char_invert(...) __lcd_char_invert(__VA_ARGS__)
+#define __lcd_char_invert(r0, r1, r2, r3, r4, r5, r6, r7) \
+  (byte)(~(r0) & B11111), (byte)(~(r1) & B11111), \
+  (byte)(~(r2) & B11111), (byte)(~(r3) & B11111), \
+  (byte)(~(r4) & B11111), (byte)(~(r5) & B11111), \
+  (byte)(~(r6) & B11111), (byte)(~(r7) & B11111)
 
-PROGMEM byte sym_ignition_off[] = {
-  B00000,
-  B01110,
-  B00100,
-  B00100,
-  B00100,
-  B00100,
-  B01110,
+#define SYM_IGNITION \
+  B00000, \
+  B01110, \
+  B00100, \
+  B00100, \
+  B00100, \
+  B00100, \
+  B01110, \
   B00000
-};
+PROGMEM byte sym_ignition_off[] = { SYM_IGNITION };
+PROGMEM byte sym_ignition_on[] = { lcd_char_invert(SYM_IGNITION) };
 
-PROGMEM byte sym_gasvalve_off[] = {
-  B00000,
-  B01110,
-  B01000,
-  B01000,
-  B01010,
-  B01010,
-  B01110,
+#define SYM_GASVALVE \
+  B00000, \
+  B01110, \
+  B01000, \
+  B01000, \
+  B01010, \
+  B01010, \
+  B01110, \
   B00000
-};
+PROGMEM byte sym_gasvalve_off[] = { SYM_GASVALVE };
+PROGMEM byte sym_gasvalve_on[] = { lcd_char_invert(SYM_GASVALVE) };
 
-PROGMEM byte sym_flame_off[] = {
-  B00000,
-  B01110,
-  B01000,
-  B01000,
-  B01110,
-  B01000,
-  B01000,
+#define SYM_FLAME \
+  B00000, \
+  B01110, \
+  B01000, \
+  B01000, \
+  B01110, \
+  B01000, \
+  B01000, \
   B00000
-};
+PROGMEM byte sym_flame_off[] = { SYM_FLAME };
+PROGMEM byte sym_flame_on[] = { lcd_char_invert(SYM_FLAME) };
 
-PROGMEM byte sym_alarm_off[] = {
-  B00000,
-  B01110,
-  B01010,
-  B01010,
-  B01110,
-  B01010,
-  B01010,
+#define SYM_ALARM \
+  B00000, \
+  B01110, \
+  B01010, \
+  B01010, \
+  B01110, \
+  B01010, \
+  B01010, \
   B00000
-};
+PROGMEM byte sym_alarm_off[] = { SYM_ALARM };
+PROGMEM byte sym_alarm_on[] = { lcd_char_invert(SYM_ALARM) };
 
 PROGMEM byte type_constant[] = {
   B00111,
@@ -1,6 +1,6 @@
 #include "pins.h"
 #include "custom_chars.h"
-#include "Program.h"
+#include "program.h"
 #include "panic.h"
 #include "display_utils.h"
 #include "utils.h"
@@ -27,17 +27,20 @@ static void setup_display() {
   uxmgr::get().show<splash_screen>();
 }
 
+static void update_display() {
+  uxmgr::get().draw();
+  flush_display();
+}
+
 static void clear_display() {
   lcd.clear();
+  reset_display();
   lcd.noBlink();
   lcd.noCursor();
   lcd.noAutoscroll();
 }
 
 class splash_screen : public ux {
-  void on_show() {
-    loadLogo();
-  }
   void draw() {
     printAt_P(7, 1, "BIRABOT");
     printAt_P(7, 2, __DATE__);
@@ -94,7 +97,7 @@ class program_abort : public ux {
   void do_program_abort() {
     // TODO
     set_temperature_target(0);
-    fs.remove(1);
+    resume_clear();
   }
   
 };
@@ -125,53 +128,55 @@ class program_run : public ux {
 
 class program_list : public ux {
   bool typing;
-  Program *prg;
+  Program prg;
   public:
-  program_list() : prg(NULL), typing(false) {
+  program_list() : typing(false) {
     load_program(2);
   }
-  ~program_list() {
-    delete prg;
-  }
   void draw() {
     char *desc;
     printAt_P(0, 0, "    PROGRAM LIST    ");
-    if (prg->is_valid()) {
-      printfAt_P(0, 1, "%03d Program      %03d", prg->id(), prg->duration());
-    } else if (fs.open(prg->id()).is_valid()) {
-      if (prg->id() == 0 || prg->id() == 1) {
-        printfAt_P(0, 1, "%03d Reserved        ", prg->id());
+    printUintAt<3, '0'>(0, 1, prg.id());
+    if (prg.is_valid()) {
+      printAt_P(3, 1, " Program      ");
+      printUintAt<3, '0'>(17, 1, prg.duration());
+    } else if (fs.open(prg.id()).is_valid()) {
+      if (prg.id() == 0 || prg.id() == 1) {
+        printAt_P(3, 1, " Reserved        ");
       } else {
-        printfAt_P(0, 1, "%03d Unknown file    ", prg->id());
+        printAt_P(3, 1, " Unknown file    ");
       }
     } else {
-      printfAt_P(0, 1, "%03d Free            ", prg->id());
+      printAt_P(3, 1, " Free            ");
     }
     clearLine(2);
     printAt_P(0, 3, "*-Back      Select-#");
   }
+  // scroll through the slots by holding A-D
+  bool repeats(char key) {
+    return key >= 'A' && key <= 'D';
+  }
   void on_key(char key) {
-    byte file_id = prg == NULL ? 1 : prg->id();
     switch (key) {
-      case 'A': typing = false; load_program(prg->id() -  1); break;
-      case 'B': typing = false; load_program(prg->id() - 10); break;
-      case 'C': typing = false; load_program(prg->id() + 10); break;
-      case 'D': typing = false; load_program(prg->id() +  1); break;
+      case 'A': typing = false; load_program(prg.id() -  1); break;
+      case 'B': typing = false; load_program(prg.id() - 10); break;
+      case 'C': typing = false; load_program(prg.id() + 10); break;
+      case 'D': typing = false; load_program(prg.id() +  1); break;
       case '0': case '1': case '2': case '3': case '4': 
       case '5': case '6': case '7': case '8': case '9': {
-        ux_input_numeric<256, 100> new_file_id = typing ? prg->id() : 0;
+        ux_input_numeric<MICROFS_EXTENT, 100> new_file_id = typing ? prg.id() : 0;
         typing = true;
         new_file_id.on_key(key);
         load_program(new_file_id);
         break;
       }
-      case '#': back(prg->id()); break;
+      case '#': back(prg.id()); break;
       case '*': back(); break;
     }
   }
-  void load_program(byte file_id) {
-    delete prg;
-    prg = new Program(file_id);
+  // the slots wrap around, skipping id 255 (MICROFS_EXTENT) which is not a file
+  void load_program(int file_id) {
+    prg.load((file_id + MICROFS_EXTENT) % MICROFS_EXTENT);
   }
 
 };
@@ -186,9 +191,11 @@ class program_list : public ux {
 class program_menu : public ux {
   char last_key;
   byte copy_source_file_id;
+  bool copy_failed;
   public:
   program_menu() {
     last_key = 0;
+    copy_failed = false;
   }
   void draw() {
     printScreen_P4(
@@ -197,9 +204,13 @@ class program_menu : public ux {
       "C-Copy      Delete-D",
       "*-Back              "
     );
+    if (copy_failed) {
+      printAt_P(8, 3, " Copy failed");
+    }
   }
   void on_key(char key) {
     last_key = key;
+    copy_failed = false;
     switch (key) {
       case 'A': 
       case 'B': 
@@ -219,21 +230,14 @@ class program_menu : public ux {
         copy_source_file_id = retVal;
         next<program_list>(); 
         break;
-      case 'c': {
+      case 'c':
         Serial.println(F("copying file"));
-        microfsfile src = fs.open(copy_source_file_id);
-        if (!src.is_valid()) {
-          Serial.println(F("src not valid"));
-        }
-        microfsfile dst = fs.create(src.get_size(), retVal);
-        if (!dst.is_valid()) {
-          Serial.println(F("dst not valid"));
-        }
-        for (int i=0; i<src.get_size(); i++) {
-          dst.write_byte(i, src.read_byte(i));
+        // don't overwrite an existing file
+        copy_failed = fs.open(retVal).is_valid() || !fs.copy(copy_source_file_id, retVal).is_valid();
+        if (copy_failed) {
+          Serial.println(F("copy failed"));
         }
         break;
-      }
       case 'D': fs.remove(retVal); break;
     }
   }
@@ -250,22 +254,20 @@ class program_menu : public ux {
 */
 class program_progress : public ux {
   int s;
-  Program *prg;
+  Program prg;
   time_t start_t;
   time_t resume_t;
   public:
-  program_progress() : s(0), prg(NULL), start_t(now()), resume_t(0) {
+  program_progress() : s(0), start_t(now()), resume_t(0) {
   }
-  ~program_progress() {
-    delete prg;
-  }
-  void on_show() {
-    loadSymbols();
+  // the clock, the temperatures and the symbols change on their own
+  unsigned refresh_period() {
+    return 1000;
   }
   void on_init(int param) {
-    prg = new Program(param);
+    prg.load(param);
     byte __resume_file_id = resume_file_id();
-    if (__resume_file_id == prg->id()) {
+    if (__resume_file_id == prg.id()) {
       int seconds = resume_seconds();
       start_t -= seconds;
     }
@@ -273,26 +275,31 @@ class program_progress : public ux {
   void draw() {
     time_t second = (now() - start_t), minute = second / 60;
     if (now() - resume_t > 15) {
-      resume_save(prg->id(), second);
+      resume_save(prg.id(), second);
       resume_t = now();
     }
     
-    set_temperature_target(prg->getTemperatureAt(minute));
+    set_temperature_target(prg.getTemperatureAt(minute));
 
     printAt_P(0, 0, "    RECIPE MODE     ");
 
-    printfAt_P(0, 1, "%02d\xdf\x7e%02d\xdf      ", 
-      get_temperature(), get_temperature_target());
-    writeAt(13, 1, alarm_on() ? 7 : 6);
+    byte x = printTempAt(0, 1, get_temperature());
+    writeAt(x++, 1, '\x7e');
+    x = printTempAt(x, 1, get_temperature_target());
+    printAt_P(x, 1, "      ");
+    writeAt(13, 1, glyph(alarm_on() ? sym_alarm_on : sym_alarm_off));
     writeAt(14, 1, ' '); 
-    writeAt(15, 1, ignition_on() ? 1 : 0);
+    writeAt(15, 1, glyph(ignition_on() ? sym_ignition_on : sym_ignition_off));
     writeAt(16, 1, ' '); 
-    writeAt(17, 1, gasvalve_on() ? 3 : 2); 
+    writeAt(17, 1, glyph(gasvalve_on() ? sym_gasvalve_on : sym_gasvalve_off)); 
     writeAt(18, 1, ' '); 
-    writeAt(19, 1, flame_on() ? 5 : 4); 
+    writeAt(19, 1, glyph(flame_on() ? sym_flame_on : sym_flame_off)); 
     
-    printfAt_P(0, 2, "%03u          %03u+%03u", 
-      prg->id(), (unsigned)minute, (unsigned)(prg->duration()-minute));
+    x = printUintAt<3, '0'>(0, 2, prg.id());
+    printAt_P(x, 2, "          ");
+    x = printUintAt<3, '0'>(x+10, 2, minute);
+    writeAt(x++, 2, '+');
+    printUintAt<3, '0'>(x, 2, prg.duration()-minute);
     
     printAt_P(0, 3, "*-Abort             ");
   }
@@ -330,22 +337,25 @@ class manual_control : public ux {
     set_temperature_target(temp_set());
   }
 
-  void on_show() {
-    loadSymbols();
+  // the temperature and the symbols change on their own
+  unsigned refresh_period() {
+    return 500;
   }
   
   void draw() {
     printAt_P(0, 0, "    MANUAL MODE     ");
 
-    printfAt_P(0, 1, "%02d\xdf\x7e%02d\xdf      ", 
-      get_temperature(), temp_set());
-    writeAt(13, 1, alarm_on() ? 7 : 6);
+    byte x = printTempAt(0, 1, get_temperature());
+    writeAt(x++, 1, '\x7e');
+    x = printTempAt(x, 1, temp_set());
+    printAt_P(x, 1, "      ");
+    writeAt(13, 1, glyph(alarm_on() ? sym_alarm_on : sym_alarm_off));
     writeAt(14, 1, ' '); 
-    writeAt(15, 1, ignition_on() ? 1 : 0);
+    writeAt(15, 1, glyph(ignition_on() ? sym_ignition_on : sym_ignition_off));
     writeAt(16, 1, ' '); 
-    writeAt(17, 1, gasvalve_on() ? 3 : 2); 
+    writeAt(17, 1, glyph(gasvalve_on() ? sym_gasvalve_on : sym_gasvalve_off)); 
     writeAt(18, 1, ' '); 
-    writeAt(19, 1, flame_on() ? 5 : 4); 
+    writeAt(19, 1, glyph(flame_on() ? sym_flame_on : sym_flame_off)); 
     
     printAt_P(0, 2, "0-9-Temperature     ");
     if (temp_valid) {
@@ -402,7 +412,7 @@ class program_setup : public ux {
   wrapping<byte, 3> field;
   byte row;
   byte rows;
-  Program *prg;
+  Program prg;
   
   ux_input_numeric<2, 1> type_mode;
   ux_input_numeric<256, 100> type_duration;
@@ -413,35 +423,38 @@ class program_setup : public ux {
     row = 0;
     rows = 0;
     field = 0;
-    prg = NULL;
-  }
-  ~program_setup() {
-    delete prg;
-  }
-  void on_show() {
-    lcdCreateCharPGM(1, type_constant, false);  
-    lcdCreateCharPGM(2, type_linear, false);  
   }
   void on_init(int param) {
     Serial.println(F("on_init"));
     Serial.println(param);
-    prg = new Program(param);
+    prg.load(param);
     reload();
   }
   void draw() {
     printAt_P(0, 0, "   PROGRAM EDITOR   ");
     
-    printfAt_P(0, 1, "%03d              %03d", 
-      prg->id(), prg->duration());
+    byte x = printUintAt<3, '0'>(0, 1, prg.id());
+    printAt_P(x, 1, "              ");
+    printUintAt<3, '0'>(x+14, 1, prg.duration());
     
-    printfAt_P(0, 2, "%02d/%02d      %c%c%c%03d%c%02d", 
-      row, rows, 
-      field == 0 ? '\x7e' : ' ', type_mode() ? '\x01' : '\x02', 
-      field == 1 ? '\x7e' : ' ', type_duration(), 
-      field == 2 ? '\x7e' : ' ', type_temp());
+    x = printUintAt<2, '0'>(0, 2, row);
+    writeAt(x++, 2, '/');
+    x = printUintAt<2, '0'>(x, 2, rows);
+    printAt_P(x, 2, "      ");
+    x += 6;
+    writeAt(x++, 2, field == 0 ? '\x7e' : ' ');
+    writeAt(x++, 2, glyph(type_mode() ? type_constant : type_linear));
+    writeAt(x++, 2, field == 1 ? '\x7e' : ' ');
+    x = printUintAt<3, '0'>(x, 2, type_duration());
+    writeAt(x++, 2, field == 2 ? '\x7e' : ' ');
+    printUintAt<2, '0'>(x, 2, type_temp());
 
     printAt_P(0, 3, "*-Back ^ADv \x7f" "BC\x7e Ins-#");
   }
+  // move between steps and fields by holding A-D
+  bool repeats(char key) {
+    return key >= 'A' && key <= 'D';
+  }
   void on_key(char key) {
     switch (key) {
       case 'A':
@@ -461,21 +474,21 @@ class program_setup : public ux {
       case '0': case '1': case '2': case '3': case '4': 
       case '5': case '6': case '7': case '8': case '9': 
         if (rows == 0) {
-          prg->addStep();
+          prg.addStep();
           reload();
         }
         switch (field) {
           case 0: 
             type_mode.on_key(key); 
-            prg->setMethod(row, type_mode()); 
+            prg.setMethod(row, type_mode()); 
             break;
           case 1: 
             type_duration.on_key(key); 
-            prg->setDuration(row, type_duration()); 
+            prg.setDuration(row, type_duration()); 
             break;
           case 2: 
             type_temp.on_key(key); 
-            prg->setTemperature(row, type_temp()); 
+            prg.setTemperature(row, type_temp()); 
             break;
         }
         break;
@@ -483,23 +496,24 @@ class program_setup : public ux {
         next<program_save>(); 
         break;
       case '#': 
-        prg->addStep(++row);
+        if (prg.addStep(row+1))
+          row++;
         reload();
         break;
     }
   }
   void on_back(int retVal) {
     if (retVal) {
-      prg->saveChanges();
+      prg.saveChanges();
     }
     back();
   }
   void reload() {
-    rows = prg->steps();
+    rows = prg.steps();
     if (rows != 0) {
-      type_mode = prg->getMethod(row);
-      type_duration = prg->getDuration(row);
-      type_temp = prg->getTemperature(row); 
+      type_mode = prg.getMethod(row);
+      type_duration = prg.getDuration(row);
+      type_temp = prg.getTemperature(row); 
     } else {
       type_mode = 0;
       type_duration = 0;
@@ -545,49 +559,104 @@ class reset_confirm : public ux {
   }
   void do_reset() {
     fs.format();
+    fs.flush();
     reset();
   }
 };
 
 class microfs_tool : public ux {
-  wrapping<int, 9> row;
-  boolean check;
-  size_t used;
-  size_t free;
-  size_t total;
-  byte files;
-  byte max_free_chunk;
-  byte free_chunks;
+  // the last 4 rows show the uxmgr stats
+  wrapping<int, 14 + 4*UXMGR_STATS> row;
+  microfsstats stats;
   public:
   microfs_tool() {
     row = 0;
-    check = fs.check_disk();
-    used = fs.used();
-    free = fs.free();
-    total = fs.total();
-    files = fs.files();
-    max_free_chunk = fs.max_free_chunk();
-    free_chunks = fs.free_chunks();
+    fs.stat(&stats);
   }
+  // these rows are read live, the others come from the snapshot in stats
+  unsigned refresh_period() {
+    switch (row) {
+      case 8:  return 500;
+      case 9:
+      case 13: return 1000;
+#if UXMGR_STATS
+      case 14:
+      case 15:
+      case 16:
+      case 17: return 1000;
+#endif
+    }
+    return 0;
+  }
+#if UXMGR_STATS
+  // min/avg/max in us on line 2
+  void draw_timing(const ux_timing& timing) {
+    writeAt(printUintAt<6, ' '>(0, 2, timing.min), 2, '/');
+    writeAt(printUintAt<6, ' '>(7, 2, timing.avg()), 2, '/');
+    printUintAt<6, ' '>(14, 2, timing.max);
+  }
+  // the slowest screen on line 1, e.g. "Draw program_setup"
+  void draw_slowest_screen() {
+    byte type = uxmgr::get().stats.slowest_screen();
+    byte x = __printAt_P(0, 1, PSTR("Draw "));
+    for (PGM_P name = ux_type_name(type); x < LCD_COLS && pgm_read_byte(name) != ',' && pgm_read_byte(name) != '\0'; name++)
+      writeAt(x++, 1, pgm_read_byte(name));
+    while (x < LCD_COLS)
+      writeAt(x++, 1, ' ');
+    draw_timing(ux_draw_stats[type]);
+  }
+  // the slowest section of loop() on line 1, e.g. "Time display"
+  void draw_slowest_slot() {
+    ux_stats& timings = uxmgr::get().stats;
+    byte slot = timings.slowest_slot();
+    byte x = __printAt_P(0, 1, PSTR("Time "));
+    if (timings.slot_names[slot] != NULL)
+      x = __printAt_P(x, 1, (const char*)timings.slot_names[slot]);
+    while (x < LCD_COLS)
+      writeAt(x++, 1, ' ');
+    draw_timing(timings.slots[slot]);
+  }
+#endif
   void draw() {
     printLineAt_P(7, 0, "TOOLS");
     switch (row) {          
-      case 0: printLineAt_P(0, 1, "Filesystem status");    if (check) { printLineAt_P(18, 2, "OK") } else { printLineAt_P(15, 2, "ERROR"); } break;
-      case 1: printLineAt_P(0, 1, "Used space");           printfAt_P(0, 2, "%20d", used); break;
-      case 2: printLineAt_P(0, 1, "Free space");           printfAt_P(0, 2, "%20d", free); break;
-      case 3: printLineAt_P(0, 1, "Total space");          printfAt_P(0, 2, "%20d", total); break;
-      case 4: printLineAt_P(0, 1, "Files");                printfAt_P(0, 2, "%20d", files); break;
-      case 5: printLineAt_P(0, 1, "Largest free chunk");   printfAt_P(0, 2, "%20d", max_free_chunk); break;
-      case 6: printLineAt_P(0, 1, "Free chunks");          printfAt_P(0, 2, "%20d", free_chunks); break;
+      case 0: printLineAt_P(0, 1, "Filesystem status");    if (stats.consistent) { printLineAt_P(18, 2, "OK") } else { printLineAt_P(15, 2, "ERROR"); } break;
+      case 1: printLineAt_P(0, 1, "Used space");           printUintAt<20, ' '>(0, 2, stats.used); break;
+      case 2: printLineAt_P(0, 1, "Free space");           printUintAt<20, ' '>(0, 2, stats.free); break;
+      case 3: printLineAt_P(0, 1, "Total space");          printUintAt<20, ' '>(0, 2, stats.total); break;
+      case 4: printLineAt_P(0, 1, "Files");                printUintAt<20, ' '>(0, 2, stats.files); break;
+      case 5: printLineAt_P(0, 1, "Largest free chunk");   printUintAt<20, ' '>(0, 2, stats.max_free_chunk); break;
+      case 6: printLineAt_P(0, 1, "Free chunks");          printUintAt<20, ' '>(0, 2, stats.free_chunks); break;
       case 7: printLineAt_P(0, 1, "Export contents");      clearLine(2); break;
-      case 8: printLineAt_P(0, 1, "Flame sensor readout"); printfAt_P(0, 2, "%20u", get_flame_level()); break;
+      case 8: printLineAt_P(0, 1, "Flame sensor readout"); printUintAt<20, ' '>(0, 2, get_flame_level()); break;
+      case 9: printLineAt_P(0, 1, "Alloc scan last/max");  writeAt(printUintAt<16, ' '>(0, 2, fs.alloc_stats().last_scan), 2, '/'); printUintAt<3, ' '>(17, 2, fs.alloc_stats().max_scan); break;
+      case 10: printLineAt_P(0, 1, "Fragmentation");       writeAt(printUintAt<19, ' '>(0, 2, stats.fragmentation), 2, '%'); break;
+      case 11: printLineAt_P(0, 1, "Largest new file");    printUintAt<20, ' '>(0, 2, stats.max_file_size); break;
+      case 12: printLineAt_P(0, 1, "Header chain");        printUintAt<20, ' '>(0, 2, stats.headers); break;
+      case 13: printLineAt_P(0, 1, "Bad CRC files");       printUintAt<20, ' '>(0, 2, fs.fsck_errors_found()); break;
+#if UXMGR_STATS
+      case 14: printLineAt_P(0, 1, "Stack never used");    printUintAt<20, ' '>(0, 2, ux_stack_unused()); break;
+      case 15: printLineAt_P(0, 1, "Loop period us");      draw_timing(uxmgr::get().stats.loops); break;
+      case 16: draw_slowest_screen(); break;
+      case 17: draw_slowest_slot(); break;
+#endif
     }
     switch (row) {
       default: printLineAt_P(0, 3, "*-Back"); break;
       case 0:  printAt_P(0, 3, "*-Back      Format-#"); break;
       case 7:  printAt_P(0, 3, "*-Back        Dump-#"); break;
+#if UXMGR_STATS
+      case 14:
+      case 15:
+      case 16:
+      case 17: printAt_P(0, 3, "*-Back        Send-#"); break;
+#endif
     }
   }
+  // scroll through the rows by holding A or D
+  bool repeats(char key) {
+    return key == 'A' || key == 'D';
+  }
   void on_key(char key) {
     switch (key) {
       case 'A': row--; break;
@@ -595,7 +664,13 @@ class microfs_tool : public ux {
       case '#': 
         switch (row) {
           case 0:  next<reset_confirm>(); break;
-          case 7:  fs.dump(); break;
+          case 7:  start_fs_export(); break;
+#if UXMGR_STATS
+          case 14:
+          case 15:
+          case 16:
+          case 17: uxmgr::get().stats.print(); break;
+#endif
         } 
         break;
       case '*': back(); break;
@@ -603,4 +678,6 @@ class microfs_tool : public ux {
   }
 };
 
-
+// every screen, to size the arena they are allocated from
+UX_ARENA(splash_screen, main_menu, program_abort, program_run, program_list, program_menu, 
+  program_progress, manual_control, program_setup, program_save, reset_confirm, microfs_tool);
@@ -3,27 +3,41 @@
 
 extern LiquidCrystal lcd;
 
-#define __string_PGM(data)                  \
-  char __buf__[sizeof(data)+1];               \
-  strcpy_P(__buf__, PSTR(data));             
+#define LCD_COLS 20
+#define LCD_ROWS 4
 
-#define __blob_PGM(blobname, size)          \
-  byte __buf__[size];                       \
-  memcpy_P(__buf__, blobname, size);         
+#ifndef LCD_FLUSH_BUDGET
+// bytes sent to the LCD by each call to flush_display(); LiquidCrystal takes ~200us per byte
+#define LCD_FLUSH_BUDGET 12
+#endif
 
-static void printAt(byte x, byte y, char *data) {
-  lcd.setCursor(x, y);
-  lcd.print(data);
-}
+// screens draw into this shadow buffer; flush_display() sends only the cells that changed
+static byte lcd_buffer[LCD_ROWS][LCD_COLS];
+// one bit per cell that differs from what the LCD shows
+static byte lcd_dirty[LCD_ROWS][(LCD_COLS+7)/8];
+// one bit per row with dirty cells
+static byte lcd_dirty_rows;
 
 static void writeAt(byte x, byte y, byte data) {
-  lcd.setCursor(x, y);
-  lcd.write(data);
+  if (x >= LCD_COLS || y >= LCD_ROWS)
+    return;
+  if (lcd_buffer[y][x] != data) {
+    lcd_buffer[y][x] = data;
+    lcd_dirty[y][x >> 3] |= _BV(x & 7);
+    lcd_dirty_rows |= _BV(y);
+  }
+}
+
+// print a string stored in flash, one character at a time; returns the column after it
+static byte __printAt_P(byte x, byte y, const char *data) {
+  char c;
+  while (x < LCD_COLS && (c = pgm_read_byte(data++)) != '\0')
+    writeAt(x++, y, c);
+  return x;
 }
 
 #define printAt_P(x, y, data) {             \
-  __string_PGM(data);                       \
-  printAt(x, y, __buf__);                   \
+  __printAt_P(x, y, PSTR(data));            \
 }
 
 #define printScreen_P(line0, line1) { \
@@ -45,64 +59,146 @@ static void writeAt(byte x, byte y, byte data) {
   clearLine(3);                                     \
 }
 
-static void printfAt(byte x, byte y, char *fmt, ...) {          
-  const int max_len = 20;                   
-  char buf[max_len+1];        
-  va_list args;
-  va_start(args, fmt);  
-  vsnprintf(buf, max_len+1, fmt, args); 
-  va_end(args);
-  printAt(x, y, buf);                       
+// print <value> at x, y, right-aligned in at least <width> cells padded with <pad>, like
+// printf("%<pad><width>d"); returns the column after the last digit
+static byte __printNumberAt(byte x, byte y, unsigned value, bool negative, byte width, char pad) {
+  char digits[3*sizeof(unsigned)];
+  byte len = 0;
+  do {
+    digits[len++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  byte fill = width > len + negative ? width - len - negative : 0;
+  if (negative && pad == '0')
+    writeAt(x++, y, '-');
+  while (fill-- > 0)
+    writeAt(x++, y, pad);
+  if (negative && pad != '0')
+    writeAt(x++, y, '-');
+  while (len > 0)
+    writeAt(x++, y, digits[--len]);
+  return x;
 }
 
-#define printfAt_P(x, y, fmt, ...) {        \
-  __string_PGM(fmt);                        \
-  printfAt(x, y, __buf__, __VA_ARGS__);     \
+template <byte width, char pad>
+static byte printUintAt(byte x, byte y, unsigned value) {
+  return __printNumberAt(x, y, value, false, width, pad);
 }
 
-#define printLineAt_P(x, y, data) {    \
-  __printLineAt_P(x, y, PSTR(data), sizeof(data)-1);      \
+template <byte width, char pad>
+static byte printIntAt(byte x, byte y, int value) {
+  return __printNumberAt(x, y, value < 0 ? -(unsigned)value : value, value < 0, width, pad);
 }
 
-static void __printLineAt_P(int x, int y, char *data, int strlen_data) {
-  const int max_len = 20;                
-  char buf[max_len+1];
-  memset(buf, ' ', max_len);
-  memcpy_P(buf+x, data, min(strlen_data, max_len-x)); 
-  buf[max_len] = '\0';
-  printAt(0, y, buf);                  
-}
-  
-static void __lcdCreateCharPGM(byte id, byte *data, boolean invert) {
-  if (invert) lcd_char_invert(data);
-  lcd.createChar(id, data);
+// a temperature in degrees, e.g. "07\xdf"
+static byte printTempAt(byte x, byte y, int temperature) {
+  x = printIntAt<2, '0'>(x, y, temperature);
+  writeAt(x++, y, '\xdf');
+  return x;
 }
 
-#define lcdCreateCharPGM(id, data, invert) {\
-  __blob_PGM(data, 8);                      \
-  __lcdCreateCharPGM(id, __buf__, invert);  \
+#define printLineAt_P(x, y, data) {    \
+  __printLineAt_P(x, y, PSTR(data));      \
 }
 
-static void loadLogo() {
-  lcdCreateCharPGM(0, logo00, false);  
-  lcdCreateCharPGM(1, logo01, false);  
-  lcdCreateCharPGM(2, logo02, false);  
-  lcdCreateCharPGM(3, logo03, false);  
-  lcdCreateCharPGM(4, logo10, false);  
-  lcdCreateCharPGM(5, logo11, false);  
-  lcdCreateCharPGM(6, logo12, false);  
-  lcdCreateCharPGM(7, logo13, false);  
+// the whole line y, blank but for <data> at column x
+static void __printLineAt_P(byte x, byte y, const char *data) {
+  byte c = 0;
+  while (c < x)
+    writeAt(c++, y, ' ');
+  c = __printAt_P(x, y, data);
+  while (c < LCD_COLS)
+    writeAt(c++, y, ' ');
 }
-
-static void loadSymbols() {
-  lcdCreateCharPGM(0, sym_ignition_off, false);  
-  lcdCreateCharPGM(1, sym_ignition_off, true);  
-  lcdCreateCharPGM(2, sym_gasvalve_off, false);  
-  lcdCreateCharPGM(3, sym_gasvalve_off, true);  
-  lcdCreateCharPGM(4, sym_flame_off, false);  
-  lcdCreateCharPGM(5, sym_flame_off, true);  
-  lcdCreateCharPGM(6, sym_alarm_off, false);  
-  lcdCreateCharPGM(7, sym_alarm_off, true);  
+  
+// CGRAM holds LCD_GLYPHS custom glyphs, glyph() uploads them on demand
+#define LCD_GLYPHS 8
+
+// PROGMEM glyph held by each slot, NULL if free
+static const byte *lcd_glyph[LCD_GLYPHS];
+// one bit per slot still to be uploaded by flush_display()
+static byte lcd_glyph_pending;
+// slots from the most to the least recently used
+static byte lcd_glyph_lru[LCD_GLYPHS] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+// character code showing <data> (8 rows in PROGMEM), loaded in the least recently used slot if
+// it is not in CGRAM already. A frame must not use more than LCD_GLYPHS different glyphs.
+// The code returned is 8-15 (the HD44780 mirrors CGRAM there) so that it is never '\0'.
+static byte glyph(const byte *data) {
+  byte i = 0;
+  while (i < LCD_GLYPHS-1 && lcd_glyph[lcd_glyph_lru[i]] != data)
+    i++;
+  byte slot = lcd_glyph_lru[i];
+  if (lcd_glyph[slot] != data) {
+    lcd_glyph[slot] = data;
+    lcd_glyph_pending |= _BV(slot);
+  }
+  for (; i > 0; i--)
+    lcd_glyph_lru[i] = lcd_glyph_lru[i-1];
+  lcd_glyph_lru[0] = slot;
+  return 8 + slot;
+}
+
+// cell (y*LCD_COLS+x) the LCD writes to next, LCD_NO_CURSOR if not known
+#define LCD_NO_CURSOR 255
+static byte lcd_cursor = LCD_NO_CURSOR;
+
+// the LCD has just been cleared: the buffer holds blanks and no cell is pending
+static void reset_display() {
+  memset(lcd_buffer, ' ', sizeof(lcd_buffer));
+  memset(lcd_dirty, 0, sizeof(lcd_dirty));
+  lcd_dirty_rows = 0;
+  lcd_cursor = 0;
+}
+
+// send up to about <budget> bytes of the pending changes to the LCD: first the glyphs to load
+// (9 bytes each), then the changed runs of cells, moving the cursor once per run. Call it until
+// it returns true to send the whole screen; loop() sends a slice per pass so that it is never
+// held up by the LCD for long.
+static bool flush_display(byte budget=LCD_FLUSH_BUDGET) {
+  int left = budget;
+  for (byte slot=0; slot<LCD_GLYPHS && lcd_glyph_pending != 0 && left > 0; slot++) {
+    if ((lcd_glyph_pending & _BV(slot)) == 0)
+      continue;
+    // a glyph is loaded in one go, if it fits or if nothing else was sent
+    if (left < 9 && left < budget)
+      break;
+    byte buf[8];
+    memcpy_P(buf, lcd_glyph[slot], sizeof(buf));
+    lcd.createChar(slot, buf);
+    lcd_glyph_pending &= ~_BV(slot);
+    lcd_cursor = LCD_NO_CURSOR;
+    left -= 9;
+  }
+  // the cells showing a glyph wait for it to be loaded
+  if (lcd_glyph_pending != 0)
+    return false;
+  for (byte y=0; y<LCD_ROWS && left > 0; y++) {
+    if ((lcd_dirty_rows & _BV(y)) == 0)
+      continue;
+    byte x = 0;
+    for (; x<LCD_COLS && left > 0; x++) {
+      if ((lcd_dirty[y][x >> 3] & _BV(x & 7)) == 0)
+        continue;
+      byte cell = y*LCD_COLS + x;
+      if (x > 0 && lcd_cursor == cell-1) {
+        // rewriting a single unchanged cell costs the same as moving the cursor over it
+        lcd.write(lcd_buffer[y][x-1]);
+        left--;
+      } else if (lcd_cursor != cell) {
+        lcd.setCursor(x, y);
+        left--;
+      }
+      lcd.write(lcd_buffer[y][x]);
+      left--;
+      lcd_dirty[y][x >> 3] &= ~_BV(x & 7);
+      // the address counter does not move to the next row
+      lcd_cursor = x < LCD_COLS-1 ? cell+1 : LCD_NO_CURSOR;
+    }
+    if (x == LCD_COLS)
+      lcd_dirty_rows &= ~_BV(y);
+  }
+  return lcd_dirty_rows == 0;
 }
 
 static void clearLine(int r) {
@@ -111,16 +207,16 @@ static void clearLine(int r) {
 }
 
 static void drawLogo(int c, int r, boolean extended=true) {
-    writeAt(c+0, r+0, 0);
-    writeAt(c+1, r+0, 1);
-    writeAt(c+2, r+0, 2);
+    writeAt(c+0, r+0, glyph(logo00));
+    writeAt(c+1, r+0, glyph(logo01));
+    writeAt(c+2, r+0, glyph(logo02));
     if (extended)
-      writeAt(c+3, r+0, 3);
-    writeAt(c+0, r+1, 4);
-    writeAt(c+1, r+1, 5);
-    writeAt(c+2, r+1, 6);
+      writeAt(c+3, r+0, glyph(logo03));
+    writeAt(c+0, r+1, glyph(logo10));
+    writeAt(c+1, r+1, glyph(logo11));
+    writeAt(c+2, r+1, glyph(logo12));
     if (extended)
-      writeAt(c+3, r+1, 7);
+      writeAt(c+3, r+1, glyph(logo13));
 }
 
 #endif // DISPLAY_UTILS
@@ -13,52 +13,111 @@ static void check_temperature() {
   flame(get_temperature_target() > get_temperature());
 }
 
-static byte resume_file_id() {
+// resume checkpoints are appended to a ring of fixed-size slots stored in file 1, so that
+// saving a checkpoint rewrites a single slot instead of deleting and recreating the file
+// a torn write leaves a slot with a bad CRC, and the previous checkpoint is used instead; the
+// records carry their own CRC, so the file is exempt from the file system one (see microfs::uncheck())
+// which would otherwise be rewritten by every checkpoint, and fail on a torn one
+struct resume_record {
+  byte seq; // sequence number, the newest valid record wins
+  byte file_id; // program being run, 0 if none
+  uint16_t seconds; // elapsed time
+  byte crc;
+};
+
+const byte resume_slots = 8;
+const byte resume_file_size = resume_slots * sizeof(resume_record);
+
+static resume_record resume_last; // newest checkpoint
+static byte resume_slot = resume_slots - 1; // slot holding resume_last
+static boolean resume_loaded = false;
+
+static byte resume_crc(resume_record& r) {
+  // the xor keeps an all-zero slot from passing the check
+  return OneWire::crc8((byte*)&r, offsetof(resume_record, crc)) ^ 0xa5;
+}
+
+// find the newest valid checkpoint in the ring
+static void resume_load() {
+  if (resume_loaded)
+    return;
+  resume_loaded = true;
+  memset(&resume_last, 0, sizeof(resume_last));
   microfsfile resumefile = fs.open(1);
-  if (!resumefile.is_valid() || resumefile.get_size() != 3) {
-    fs.remove(1);
-    return 0;
+  if (!resumefile.is_valid() || resumefile.get_size() != resume_file_size)
+    return;
+  // a file from before the exemption
+  fs.uncheck(1);
+  boolean found = false;
+  for (byte i=0; i<resume_slots; i++) {
+    resume_record r;
+    if (resumefile.read_bytes(i*sizeof(r), (byte*)&r, sizeof(r)) != sizeof(r) || r.crc != resume_crc(r))
+      continue;
+    if (!found || (int8_t)(r.seq - resume_last.seq) > 0) {
+      resume_last = r;
+      resume_slot = i;
+      found = true;
+    }
   }
-  byte file_id = resumefile.read_byte(0);
-  if (fs.open(file_id).is_valid()) {
+}
+
+static byte resume_file_id() {
+  resume_load();
+  byte file_id = resume_last.file_id;
+  if (file_id != 0 && fs.open(file_id).is_valid()) {
     return file_id;
   }
   return 0;
 }
 
 static int resume_seconds() {
-  microfsfile resumefile = fs.open(1);
-  if (!resumefile.is_valid() || resumefile.get_size() != 3) {
-    fs.remove(1);
-    return 0; // FIXME
-  }
-  byte buf[2] = {0};
-  if (resumefile.read_bytes(1, buf, sizeof(buf)) == sizeof(buf))
-    return *(size_t*)buf;
-  return 0; // FIXME
+  resume_load();
+  return resume_last.seconds;
 }
 
 static void resume_save(byte file_id, int seconds) {
   Serial.println(F("resume_save"));
   Serial.println(file_id);
   Serial.println(seconds);
-  if (!fs.remove(1)) {
-    Serial.println(F("failed to delete resume file"));
-  }
-  microfsfile resumefile = fs.create(3, 1);
-  if (!resumefile.is_valid() || resumefile.get_size() != 3 || resumefile.get_id() != 1) {
+  resume_load();
+  microfsfile resumefile = fs.open(1);
+  if (!resumefile.is_valid() || resumefile.get_size() != resume_file_size) {
     fs.remove(1);
-    Serial.println(F("failed to create resume file"));
-    return;
+    resumefile = fs.create(resume_file_size, 1);
+    if (!resumefile.is_valid()) {
+      Serial.println(F("failed to create resume file"));
+      return;
+    }
+    fs.uncheck(1);
+    // the file reuses free space, whose stale bytes could pass for a newer checkpoint; zeroed
+    // slots never pass the CRC
+    resume_record blank;
+    memset(&blank, 0, sizeof(blank));
+    for (byte i=0; i<resume_slots; i++) {
+      if (resumefile.write_bytes(i*sizeof(blank), (byte*)&blank, sizeof(blank)) != sizeof(blank)) {
+        Serial.println(F("failed to clear resume file"));
+        fs.remove(1);
+        return;
+      }
+    }
   }
-  byte buf[3] = {0};
-  buf[0] = file_id;
-  *(size_t*)(buf+1) = seconds;
-  if (resumefile.write_bytes(0, buf, sizeof(buf)) != sizeof(buf)) {
-    fs.remove(1);
+  resume_record r;
+  r.seq = resume_last.seq + 1;
+  r.file_id = file_id;
+  r.seconds = seconds;
+  r.crc = resume_crc(r);
+  byte slot = (resume_slot + 1) % resume_slots;
+  if (resumefile.write_bytes(slot*sizeof(r), (byte*)&r, sizeof(r)) != sizeof(r)) {
     Serial.println(F("failed to save resume file"));
     return;
   }
+  resume_last = r;
+  resume_slot = slot;
+}
+
+// record that no program is running
+static void resume_clear() {
+  resume_save(0, 0);
 }
 
 static void resume() {
@@ -67,7 +126,10 @@ static void resume() {
     Serial.println(F("resume"));
     Serial.println(file_id);
     Serial.println(resume_seconds());
+    // show the program on top of the main menu, without showing the menu first
+    uxmgr::get().defer();
     uxmgr::get().show<main_menu>();
     uxmgr::get().next<program_progress>(file_id);
+    uxmgr::get().commit();
   }
 }
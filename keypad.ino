@@ -31,18 +31,89 @@ PROGMEM const byte alphakeys_idx[] = {
   0, 3, 6, 9, 12, 15, 19, 23, 27, 31, 38
 };
 
-Keypad keypad( makeKeymap(keys), rowPins, colPins, rows, cols );
+// the keypad is scanned from the timer every keypad_scan_interval ms (see setup_safety()) and the
+// debounced presses and releases are queued for loop(), so that keys are not missed or delayed
+// while loop() is busy
+const byte keypad_scan_interval = 10; // ms
+// a change is reported once the keypad has read the same for this many scans in a row
+const byte keypad_debounce_scans = 3;
 
-void keypad_event_handler(KeypadEvent key) {
-  if (keypad.isPressed(key)) {
-    uxmgr::get().on_key(key);
+struct key_event {
+  char key;
+  boolean pressed; // pressed or released
+  uint16_t time; // millis() when the change was detected
+};
+
+// single producer (the timer) single consumer (loop()) ring of key events
+const byte key_events_size = 8; // a power of two
+static key_event key_events[key_events_size];
+static volatile byte key_events_head = 0; // written by the timer only
+static volatile byte key_events_tail = 0; // written by loop() only
+
+static char keypad_key = 0; // debounced key held down, 0 if none
+static char keypad_candidate = 0; // key read by the last scans
+static byte keypad_candidate_scans = 0;
+
+static void setup_keypad() {
+  for (byte c=0; c<cols; c++)
+    pinMode(colPins[c], INPUT_PULLUP);
+  for (byte r=0; r<rows; r++)
+    pinMode(rowPins[r], INPUT);
+}
+
+// the key held down, 0 if none; if more than one is, the last one in the matrix wins
+static char keypad_read() {
+  char key = 0;
+  for (byte r=0; r<rows; r++) {
+    pinMode(rowPins[r], OUTPUT);
+    digitalWrite(rowPins[r], LOW);
+    for (byte c=0; c<cols; c++) {
+      if (digitalRead(colPins[c]) == LOW)
+        key = keys[r][c];
+    }
+    pinMode(rowPins[r], INPUT);
   }
+  return key;
 }
 
-static void setup_keypad() {
-  keypad.addEventListener(keypad_event_handler);  
+// called by the timer: events are dropped if loop() lets the ring fill up, but a press is only
+// queued if there is room left for its release, so that a key never stays held down in uxmgr
+static void key_event_push(char key, boolean pressed) {
+  byte head = key_events_head;
+  if ((byte)(head - key_events_tail) >= key_events_size - (pressed ? 1 : 0))
+    return;
+  key_event& e = key_events[head & (key_events_size-1)];
+  e.key = key;
+  e.pressed = pressed;
+  e.time = millis();
+  // the event must be written before it is published
+  __asm__ __volatile__("" ::: "memory");
+  key_events_head = head + 1;
+}
+
+// called by the timer
+static void keypad_scan() {
+  char key = keypad_read();
+  if (key != keypad_candidate) {
+    keypad_candidate = key;
+    keypad_candidate_scans = 0;
+  }
+  if (keypad_candidate_scans < keypad_debounce_scans && ++keypad_candidate_scans == keypad_debounce_scans && key != keypad_key) {
+    if (keypad_key != 0)
+      key_event_push(keypad_key, false);
+    if (key != 0)
+      key_event_push(key, true);
+    keypad_key = key;
+  }
 }
 
+// hand the queued key events to uxmgr, which also takes care of long presses and auto-repeat
 static void poll_keypad() {
-  keypad.getKeys();
+  while (key_events_tail != key_events_head) {
+    __asm__ __volatile__("" ::: "memory");
+    key_event e = key_events[key_events_tail & (key_events_size-1)];
+    key_events_tail++;
+    uxmgr::get().on_key_event(e.key, e.pressed, e.time);
+  }
+  uxmgr::get().poll_keys(millis());
 }
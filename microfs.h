@@ -3,16 +3,19 @@
   A low-footprint wear-leveling file system for Arduino/AVR microcontrollers
   
   features:
-  - 2 byte on-disk overhead per file
-  - 4 byte in-memory overhead per open file
-  - (optional) wear-levelling
+  - 2 byte on-disk overhead per file (3 with MICROFS_FILE_CRC)
+  - 6 byte in-memory overhead per open file
+  - (optional) wear-levelling, see MICROFS_ALLOC
+  - (optional) in-RAM header index, see MICROFS_INDEX_ENTRIES
+  - pluggable storage backends: AVR EEPROM, RAM buffer, memory mapped file (on the host)
   
   limits:
-  - 255 files (files are unnamed, can be identified using a number from 1 to 255 inclusive)
-  - 0-255 bytes per file
+  - 254 files (files are unnamed, can be identified using a number from 1 to 254 inclusive)
+  - 0-64517 bytes per file (files larger than 255 bytes have continuation extents)
+  - up to 64KB of storage
   - no directories, ACLs, file[cma]time, etc.
-  - files are allocated as contiguos chunks of EEPROM, file fragments are not allowed 
-    (this implies that to allocate a file of size N bytes, a chunk of size N+2 must be free)
+  - files are allocated as contiguos chunks of EEPROM of up to 255 bytes
+    (this implies that to allocate a file of size N<=255 bytes, a chunk of size N+2 (N+3) must be free)
   - if power is lost (or execution halted) inside a CRITICAL SECTION, the whole fs is corrupted
   
   design:
@@ -27,35 +30,339 @@
   |+- byte file_length 
   +- byte file_id 
   
+  With MICROFS_FILE_CRC the header has a third byte, the CRC-8 of the file id, length and data 
+  (ILCDDD...), and the stride is file_length + 3. The CRC byte of unallocated chunks is unused.
+  
   Files are placed one after another with no padding in between. This effectively yields an on-disk
   linked list: to get the position of the header of the following file, we just need to add the 
   stride to the position of the current file header.
   
-  file_ids are required to be unique and in the range 1-255 inclusive: file_id 0 is used to mark 
+  file_ids are required to be unique and in the range 1-254 inclusive: file_id 0 is used to mark 
   unallocated space and can occur multiple times
+  
+  A file larger than 255 bytes is stored as a full 255 byte chunk followed by continuation extents:
+  chunks with id 255 (MICROFS_EXTENT) whose data starts with a 2 byte tag, the id of the file and 
+  the number of the extent (from 1). Each extent holds up to 253 bytes of the file, and all the 
+  extents but the last one are full, so the extent holding a position is found by a division. 
+  Files of up to 255 bytes have no extents and keep the overhead of a single header (2 bytes, 3
+  with MICROFS_FILE_CRC). mount() frees the extents left behind by a power loss (duplicates, and
+  extents not preceded by a full chunk of their file), and gives a free id to a file with id 255
+  written before extents existed.
+
+  Walking the on-disk linked list means reading two EEPROM bytes per header. To avoid doing so on
+  every lookup, mount() copies the header chain into a small in-RAM index (4 bytes per header, plus 
+  a 32 byte bitmap of the ids in use); write_header() keeps it coherent with what goes to disk. If 
+  the disk holds more headers than MICROFS_INDEX_ENTRIES, the index is dropped and microfs falls 
+  back to scanning the EEPROM.
+
+  Free space gets fragmented as files are removed. compact() defragments it incrementally, copying 
+  at most MICROFS_COMPACT_STEP bytes per call so that it can run from loop(). Adjacent free chunks 
+  are merged, and files are moved into free chunks found before them. A file is never moved over 
+  itself: it is first copied inside the free chunk, then the header of the copy is written and 
+  finally the original is marked as free. The header writes are single byte updates, so a power 
+  loss can at worst leave two copies of a file: mount() detects this and drops the later one. If 
+  a file is too big for the free chunk before it, it may be moved out of the way to a later free 
+  chunk, so that the free space around its old position can coalesce.
+
+  With MICROFS_FILE_CRC, writes through microfsfile recompute the CRC of the file, and open() 
+  verifies it the first time a file is opened after mount(): files that don't match are reported 
+  and can't be opened (they can still be overwritten with write_file() or removed). fsck() checks 
+  all files in the background, one per call. A power loss while a file is being written leaves 
+  it with a bad CRC. uncheck() exempts a file from the CRC, by storing MICROFS_NO_CRC in place of 
+  it: files that are rewritten often and check their own contents (e.g. a ring of records with a 
+  CRC each) are then spared the rewrite of their CRC byte on every write.
+
+  resize() changes the size of a file in place when the space after it allows it, and otherwise
+  moves it to a free chunk that is big enough, using the same copy-then-switch sequence as compact().
+
+  The storage device is a template parameter of microfs_t and microfsfile_t. A storage class has 
+  only static members (so that open files don't need to point to it):
+    size_t size()                                          size of the device in bytes
+    byte read(size_t pos)                                  read a byte
+    bool update(size_t pos, byte val)                      write a byte, if it changed
+    bool read_block(size_t pos, byte* buf, size_t len)     read <len> bytes
+    bool update_block(size_t pos, const byte* buf, size_t len)  write <len> bytes, skipping unchanged ones
+    bool flush()                                           wait until all writes are durable
+    bool idle()                                            true if no writes are pending
+    unsigned generation()                                  incremented when a byte is actually written
+  microfs_eeprom is the internal EEPROM of the AVR, microfs_ram<N> a RAM buffer of N bytes; see 
+  microfs_host.h for a memory mapped file, to run the file system on a PC. On AVR, microfs and 
+  microfsfile are the file system on the internal EEPROM, and fs is its instance.
+
+  export_frame() streams a copy of the whole storage one text line at a time, so that it can be 
+  sent over a serial port from loop() without blocking; import_frame() restores it. Each line is a 
+  ':' followed by the Base64 encoding of a frame:
+    'S' size(3)              start of the export, size of the storage in bytes
+    'D' offset(2) data(N)    up to MICROFS_FRAME_DATA bytes of storage starting at offset
+    'E' crc(2)               end of the export, CRC of the whole storage
+  followed by the CRC of the frame itself (2 bytes). All numbers are big-endian, CRCs are 
+  CRC-16/CCITT. If the storage is written while an export is in progress, the export restarts with 
+  a new 'S' frame. See tools/microfs_export.cpp to decode an export on a PC.
 
   TODO:
-  - files can't be changed in size (extend in place, copy-and-extend)
-  - free space defragmentation
   - full crash-proofing
 */
 
 #ifndef MICROFS
 #define MICROFS
 
+#ifndef MICROFS_INDEX_ENTRIES
+// maximum number of headers (allocated and unallocated) held in the in-RAM index
+// each entry costs 4 bytes of RAM; set to 0 to disable the index altogether
+#define MICROFS_INDEX_ENTRIES 16
+#endif
+
+#define MICROFS_ALLOC_FIRST_FIT 0
+#define MICROFS_ALLOC_BEST_FIT 1
+#define MICROFS_ALLOC_RANDOM 2
+
+#ifndef MICROFS_ALLOC
+#define MICROFS_ALLOC MICROFS_ALLOC_FIRST_FIT
+#endif
+
+#ifndef MICROFS_COMPACT_STEP
+// maximum number of bytes copied by each call to microfs::compact()
+#define MICROFS_COMPACT_STEP 4
+#endif
+
+#ifndef MICROFS_WRITE_QUEUE
+// number of byte writes that can be pending in the interrupt-driven write queue (3 bytes of RAM 
+// each); set to 0 to make writes synchronous
+#define MICROFS_WRITE_QUEUE 16
+#endif
+
+#ifndef MICROFS_FILE_CRC
+// set to 1 to add a CRC byte to file headers, see microfs::open() and microfs::fsck()
+// note: this changes the on-disk format, the EEPROM has to be formatted again
+#define MICROFS_FILE_CRC 0
+#endif
+
+// bytes of the header in front of each chunk
+#define MICROFS_HEADER (2 + MICROFS_FILE_CRC)
+
+// CRC byte of the chunks of a file exempt from the CRC, see microfs::uncheck(); a chunk whose CRC 
+// would be this value stores MICROFS_NO_CRC+1 instead
+#define MICROFS_NO_CRC 0
+
+// id of the continuation extents of files larger than 255 bytes
+#define MICROFS_EXTENT 255
+// bytes of file data held by a continuation extent, after its 2 byte tag
+#define MICROFS_EXTENT_DATA 253
+// largest file: the first chunk plus 254 continuation extents
+#define MICROFS_MAX_FILE_SIZE (255 + 254 * (uint16_t)MICROFS_EXTENT_DATA)
+
+#ifndef MICROFS_FRAME_DATA
+// bytes of storage carried by each line of an export, see microfs::export_frame()
+#define MICROFS_FRAME_DATA 24
+#endif
+
+// length of an export line, including the ':' and the NUL terminator
+#define MICROFS_FRAME_LINE (2 + (MICROFS_FRAME_DATA + 5 + 2) / 3 * 4)
+
+#if MICROFS_FILE_CRC
+// CRC-8/MAXIM, used to check the contents of files
+static byte microfs_crc8(byte crc, const byte* buf, size_t len) {
+  while (len--) {
+    crc ^= *buf++;
+    for (byte i=0; i<8; i++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x8c : crc >> 1;
+  }
+  return crc;
+}
+#endif
+
+// CRC-16/CCITT, used to protect exports
+static uint16_t microfs_crc16(uint16_t crc, const byte* buf, size_t len) {
+  while (len--) {
+    crc ^= (uint16_t)*buf++ << 8;
+    for (byte i=0; i<8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// Base64 digit of a 6 bit value
+static char microfs_b64_digit(byte v) {
+  return v < 26 ? 'A'+v : v < 52 ? 'a'+v-26 : v < 62 ? '0'+v-52 : v == 62 ? '+' : '/';
+}
+
+// value of a Base64 digit, 0xff if <c> is not one
+static byte microfs_b64_value(char c) {
+  if (c >= 'A' && c <= 'Z') return c-'A';
+  if (c >= 'a' && c <= 'z') return c-'a'+26;
+  if (c >= '0' && c <= '9') return c-'0'+52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return 0xff;
+}
+
+// encode <len> bytes of <buf> to Base64 in <out> (NUL-terminated, (len+2)/3*4+1 bytes)
+static void microfs_b64_encode(const byte* buf, size_t len, char* out) {
+  for (size_t i=0; i<len; i+=3) {
+    unsigned long v = (unsigned long)buf[i] << 16;
+    if (i+1 < len) v |= (unsigned)buf[i+1] << 8;
+    if (i+2 < len) v |= buf[i+2];
+    *out++ = microfs_b64_digit(v >> 18);
+    *out++ = microfs_b64_digit((v >> 12) & 63);
+    *out++ = i+1 < len ? microfs_b64_digit((v >> 6) & 63) : '=';
+    *out++ = i+2 < len ? microfs_b64_digit(v & 63) : '=';
+  }
+  *out = 0;
+}
+
+// decode the NUL-terminated Base64 string <in> to at most <max> bytes of <buf>
+// returns the number of bytes decoded, or -1 if <in> is malformed or too long
+static int microfs_b64_decode(const char* in, byte* buf, size_t max) {
+  size_t len = 0;
+  while (*in) {
+    byte d[4];
+    byte n = 0;
+    for (byte i=0; i<4; i++) {
+      if (in[i] == '=' && i >= 2) {
+        d[i] = 0;
+        continue;
+      }
+      d[i] = microfs_b64_value(in[i]); // also catches a NUL in the middle of a group
+      if (d[i] == 0xff || n < i)
+        return -1;
+      n++;
+    }
+    in += 4;
+    if (n < 4 && *in)
+      return -1; // padding before the end
+    unsigned long v = (unsigned long)d[0] << 18 | (unsigned long)d[1] << 12 | d[2] << 6 | d[3];
+    for (byte i=0; i<n-1; i++) {
+      if (len >= max)
+        return -1;
+      buf[len++] = v >> (16-8*i);
+    }
+  }
+  return len;
+}
+
+#ifdef __AVR__
 #include <avr/eeprom.h>
 
+#if MICROFS_WRITE_QUEUE > 0
+#include <util/atomic.h>
+
+struct eeprom_write {
+  uint16_t pos;
+  byte val;
+};
+
+static volatile eeprom_write eeprom_queue[MICROFS_WRITE_QUEUE];
+static volatile byte eeprom_queue_head = 0; // oldest pending write
+static volatile byte eeprom_queue_len = 0;
+static volatile eeprom_write eeprom_inflight; // write being programmed, checked on completion
+static volatile bool eeprom_inflight_valid = false;
+static volatile unsigned eeprom_write_errors = 0;
+
+// fired when the EEPROM is ready to accept a new write
+ISR(EE_READY_vect) {
+  // the previous write has completed: read it back
+  if (eeprom_inflight_valid) {
+    EEAR = eeprom_inflight.pos;
+    EECR |= _BV(EERE);
+    if (EEDR != eeprom_inflight.val)
+      eeprom_write_errors++;
+    eeprom_inflight_valid = false;
+  }
+  if (eeprom_queue_len == 0) {
+    EECR &= ~_BV(EERIE);
+    return;
+  }
+  eeprom_inflight.pos = eeprom_queue[eeprom_queue_head].pos;
+  eeprom_inflight.val = eeprom_queue[eeprom_queue_head].val;
+  eeprom_inflight_valid = true;
+  eeprom_queue_head = (eeprom_queue_head + 1) % MICROFS_WRITE_QUEUE;
+  eeprom_queue_len--;
+  EEAR = eeprom_inflight.pos;
+  EEDR = eeprom_inflight.val;
+  EECR |= _BV(EEMPE);
+  EECR |= _BV(EEPE);
+}
+
+// find the latest pending value for <pos>; must be called with interrupts disabled
+static bool eeprom_queued(size_t pos, byte* val) {
+  bool found = false;
+  for (byte i=0; i<eeprom_queue_len; i++) {
+    volatile eeprom_write& w = eeprom_queue[(eeprom_queue_head + i) % MICROFS_WRITE_QUEUE];
+    if (w.pos == pos) {
+      *val = w.val;
+      found = true;
+    }
+  }
+  return found;
+}
+
+// append a write to the queue, waiting for a free slot if the queue is full
+static void eeprom_enqueue(size_t pos, byte val) {
+  while (true) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (eeprom_queue_len < MICROFS_WRITE_QUEUE) {
+        volatile eeprom_write& w = eeprom_queue[(eeprom_queue_head + eeprom_queue_len) % MICROFS_WRITE_QUEUE];
+        w.pos = pos;
+        w.val = val;
+        eeprom_queue_len++;
+        EECR |= _BV(EERIE);
+        return;
+      }
+    }
+  }
+}
+#endif // MICROFS_WRITE_QUEUE
+
+// incremented on each byte actually written to the EEPROM
+static unsigned eeprom_generation = 0;
+
+// true if a write would not have to wait for the EEPROM
+static bool eeprom_idle() {
+#if MICROFS_WRITE_QUEUE > 0
+  return eeprom_queue_len == 0;
+#else
+  return true;
+#endif
+}
+
+// wait until all pending writes have reached the EEPROM
+// returns false if any write failed verification since the last call
+static bool eeprom_flush() {
+#if MICROFS_WRITE_QUEUE > 0
+  while (eeprom_queue_len > 0 || eeprom_inflight_valid)
+    ;
+  bool ok;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    ok = eeprom_write_errors == 0;
+    eeprom_write_errors = 0;
+  }
+  return ok;
+#else
+  return true;
+#endif
+}
+
 static byte eeprom_read(size_t pos) {
-  if (pos < 0 || pos > E2END) {
+  if (pos > E2END) {
     Serial.println(F("eeprom read oob"));
     Serial.println(pos);
     return 0;
   }
+#if MICROFS_WRITE_QUEUE > 0
+  // the interrupt must not move EEAR while we read
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    byte val;
+    if (eeprom_queued(pos, &val))
+      return val;
+    return eeprom_read_byte((uint8_t*)pos);
+  }
+#endif
   return eeprom_read_byte((uint8_t*)pos);
 }
 
+// with the write queue enabled <check_after_write> is performed asynchronously, see eeprom_flush()
 static bool eeprom_update(size_t pos, byte val, bool check_after_write = true) {
-  if (pos < 0 || pos > E2END)
+  if (pos > E2END)
     return false;
   /* the avr/eeprom.h for arduino appears to lack eeprom_update_byte:
      since reading from EEPROM appears to be way faster than writing 
@@ -63,45 +370,180 @@ static bool eeprom_update(size_t pos, byte val, bool check_after_write = true) {
      correct value: if this is the case, simply return success immediately */
   if (eeprom_read(pos) == val)
     return true;
+  eeprom_generation++;
+#if MICROFS_WRITE_QUEUE > 0
+  eeprom_enqueue(pos, val);
+  return true;
+#else
   eeprom_write_byte((uint8_t*)pos, val);
   return check_after_write ? eeprom_read(pos) == val : true;
+#endif
+}
+
+// read <len> bytes starting at <pos> into <buf>
+static bool eeprom_read_range(size_t pos, byte* buf, size_t len) {
+  if (pos > E2END || len > E2END+1-pos)
+    return false;
+#if MICROFS_WRITE_QUEUE > 0
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    eeprom_read_block(buf, (const void*)pos, len);
+    // overlay the writes that are still pending, oldest first
+    for (byte i=0; i<eeprom_queue_len; i++) {
+      volatile eeprom_write& w = eeprom_queue[(eeprom_queue_head + i) % MICROFS_WRITE_QUEUE];
+      if (w.pos >= pos && w.pos < pos+len)
+        buf[w.pos-pos] = w.val;
+    }
+  }
+#else
+  eeprom_read_block(buf, (const void*)pos, len);
+#endif
+  return true;
+}
+
+// write <len> bytes from <buf> starting at <pos>; bytes already holding the correct value are not 
+// rewritten. if <check_after_write> is set the whole range is read back once and compared with <buf>
+// (with the write queue enabled the check is performed asynchronously, see eeprom_flush())
+static bool eeprom_update_range(size_t pos, const byte* buf, size_t len, bool check_after_write = true) {
+  if (pos > E2END || len > E2END+1-pos)
+    return false;
+#if MICROFS_WRITE_QUEUE > 0
+  for (size_t i=0; i<len; i++)
+    eeprom_update(pos+i, buf[i]);
+  return true;
+#else
+  eeprom_update_block(buf, (void*)pos, len);
+  eeprom_generation++;
+  if (!check_after_write)
+    return true;
+  byte chunk[16];
+  for (size_t i=0; i<len; i+=sizeof(chunk)) {
+    size_t n = min(sizeof(chunk), len-i);
+    eeprom_read_block(chunk, (const void*)(pos+i), n);
+    if (memcmp(chunk, buf+i, n) != 0)
+      return false;
+  }
+  return true;
+#endif
 }
 
-class microfsfile {
+// the internal EEPROM of the AVR
+class microfs_eeprom {
+  public:
+  static size_t size() {
+    return E2END+1;
+  }
+  static byte read(size_t pos) {
+    return eeprom_read(pos);
+  }
+  static bool update(size_t pos, byte val) {
+    return eeprom_update(pos, val);
+  }
+  static bool read_block(size_t pos, byte* buf, size_t len) {
+    return eeprom_read_range(pos, buf, len);
+  }
+  static bool update_block(size_t pos, const byte* buf, size_t len) {
+    return eeprom_update_range(pos, buf, len);
+  }
+  static bool flush() {
+    return eeprom_flush();
+  }
+  static bool idle() {
+    return eeprom_idle();
+  }
+  static unsigned generation() {
+    return eeprom_generation;
+  }
+};
+#endif // __AVR__
+
+// a RAM buffer of <N> bytes (the contents are lost on reset)
+template <size_t N>
+class microfs_ram {
+  static byte data[N];
+  static unsigned writes;
+  public:
+  static size_t size() {
+    return N;
+  }
+  static byte read(size_t pos) {
+    return pos < N ? data[pos] : 0;
+  }
+  static bool update(size_t pos, byte val) {
+    if (pos >= N)
+      return false;
+    if (data[pos] != val) {
+      data[pos] = val;
+      writes++;
+    }
+    return true;
+  }
+  static bool read_block(size_t pos, byte* buf, size_t len) {
+    if (pos > N || len > N-pos)
+      return false;
+    memcpy(buf, data+pos, len);
+    return true;
+  }
+  static bool update_block(size_t pos, const byte* buf, size_t len) {
+    if (pos > N || len > N-pos)
+      return false;
+    for (size_t i=0; i<len; i++)
+      update(pos+i, buf[i]);
+    return true;
+  }
+  static bool flush() {
+    return true;
+  }
+  static bool idle() {
+    return true;
+  }
+  static unsigned generation() {
+    return writes;
+  }
+};
+
+template <size_t N> byte microfs_ram<N>::data[N];
+template <size_t N> unsigned microfs_ram<N>::writes = 0;
+
+template <class storage>
+class microfsfile_t {
   
-  friend class microfs;
+  template <class> friend class microfs_t;
   
   // IN-EEPROM MEMBERS //
   byte id; // id of the file, id 0 is reserved for unallocated space
-  byte size; // size of file (bytes)
+  byte size; // size of the chunk (bytes), the whole file unless it has continuation extents
   
   // IN-MEMORY MEMBERS //
   size_t offset; // offset of file header in EEPROM
+  uint16_t length; // size of the file (bytes), including the continuation extents
 
   // construct the "invalid" file
-  microfsfile() {
+  microfsfile_t() {
     id = 0;
     size = 0;
     offset = -1;
+    length = 0;
   }
   
   // construct an unallocated file
-  microfsfile(byte file_id, byte file_size) {
+  microfsfile_t(byte file_id, byte file_size) {
     id = file_id;
     size = file_size;
     offset = -1;
+    length = file_size;
   }
   
   // construct an allocated file
-  microfsfile(byte file_id, byte file_size, size_t eeprom_offset) {
+  microfsfile_t(byte file_id, byte file_size, size_t eeprom_offset) {
     id = file_id;
     size = file_size;
     offset = eeprom_offset;
+    length = file_size;
   }
   
   // distance from the current header to the next one
   size_t stride() {
-    return ((size_t)2) + ((size_t)size);
+    return ((size_t)MICROFS_HEADER) + ((size_t)size);
   }
   
   // true if this is an unallocated chunk that can be merged with one of its neighbors
@@ -109,15 +551,141 @@ class microfsfile {
     return is_valid() && (id == 0) && (size < 255);
   }  
   
+  // number of continuation extents needed by a file of <len> bytes
+  static byte extents(uint16_t len) {
+    return len > 255 ? (len - 255 + MICROFS_EXTENT_DATA - 1) / MICROFS_EXTENT_DATA : 0;
+  }
+  
+  // continuation extent number <seq> (1 being the first) of file <owner>, found by walking the 
+  // header chain on disk
+  static microfsfile_t find_extent(byte owner, byte seq) {
+    size_t pos = 0;
+    while (pos + MICROFS_HEADER <= storage::size()) {
+      microfsfile_t f(storage::read(pos), storage::read(pos+1), pos);
+      if (f.id == MICROFS_EXTENT && f.size >= 2 && f.tag(0) == owner && f.tag(1) == seq)
+        return f;
+      pos += f.stride();
+    }
+    return microfsfile_t();
+  }
+  
+  // byte <i> of the tag of a continuation extent: 0 is the owner file, 1 the extent number
+  byte tag(byte i) {
+    return storage::read(offset + MICROFS_HEADER + i);
+  }
+  
+  // find the chunk holding position <pos> of the file: <at> is the position inside the chunk
+  // and <room> the number of bytes of the file stored from there to the end of the chunk
+  bool locate(uint16_t pos, microfsfile_t* chunk, byte* at, byte* room) {
+    if (pos < size) {
+      *chunk = *this;
+      *at = pos;
+    } else {
+      pos -= 255;
+      *chunk = find_extent(id, 1 + pos / MICROFS_EXTENT_DATA);
+      *at = 2 + pos % MICROFS_EXTENT_DATA;
+    }
+    if (!chunk->is_valid() || *at >= chunk->size)
+      return false;
+    *room = chunk->size - *at;
+    return true;
+  }
+  
+#if MICROFS_FILE_CRC
+  // CRC of the header and the data of the chunk, as currently found on disk
+  byte crc() {
+    byte hdr[2] = {id, size};
+    byte c = microfs_crc8(0, hdr, sizeof(hdr));
+    byte buf[16];
+    for (int i=0; i<size; i+=sizeof(buf)) {
+      byte n = min(sizeof(buf), size-i);
+      storage::read_block(offset + MICROFS_HEADER + i, buf, n);
+      c = microfs_crc8(c, buf, n);
+    }
+    return c != MICROFS_NO_CRC ? c : MICROFS_NO_CRC+1;
+  }
+#endif
+  
+  // true if the chunk is exempt from the CRC, see microfs::uncheck()
+  bool unchecked() {
+#if MICROFS_FILE_CRC
+    return storage::read(offset + 2) == MICROFS_NO_CRC;
+#else
+    return true;
+#endif
+  }
+  
+  // store the CRC of the chunk in its header, unless it is exempt from it
+  bool seal() {
+#if MICROFS_FILE_CRC
+    if (unchecked())
+      return true;
+    return storage::update(offset + 2, crc());
+#else
+    return true;
+#endif
+  }
+  
+  // store the CRC of a new chunk, whose CRC byte is still whatever the free space held, or 
+  // MICROFS_NO_CRC if <checked> is false
+  bool seal_new(bool checked=true) {
+#if MICROFS_FILE_CRC
+    return storage::update(offset + 2, checked ? crc() : MICROFS_NO_CRC);
+#else
+    (void)checked;
+    return true;
+#endif
+  }
+  
+  // true if the chunk matches the CRC in its header, or is exempt from it
+  bool verify_chunk() {
+#if MICROFS_FILE_CRC
+    byte c = storage::read(offset + 2);
+    return c == MICROFS_NO_CRC || c == crc();
+#else
+    return true;
+#endif
+  }
+  
+  // true if all the chunks of the file match their CRC
+  bool verify() {
+    if (!verify_chunk())
+      return false;
+    for (byte seq=1; seq<=extents(length); seq++) {
+      if (!find_extent(id, seq).verify_chunk())
+        return false;
+    }
+    return true;
+  }
+  
+  // copy up to <len> bytes between <buf> and the file starting at position <pos>
+  // the copy is clipped at the end of the file; returns the number of bytes copied
+  uint16_t transfer(uint16_t pos, byte* buf, uint16_t len, bool write) {
+    uint16_t n = min(len, (uint16_t)(length-pos));
+    uint16_t done = 0;
+    while (done < n) {
+      microfsfile_t chunk;
+      byte at, room;
+      if (!locate(pos+done, &chunk, &at, &room))
+        break;
+      byte k = min((uint16_t)room, (uint16_t)(n-done));
+      size_t off = chunk.offset + MICROFS_HEADER + at;
+      if (write ? !storage::update_block(off, buf+done, k) || !chunk.seal() : !storage::read_block(off, buf+done, k))
+        break;
+      done += k;
+    }
+    return done;
+  }
+  
   public:
   // true if the file is on disk
   bool is_valid() {
-    return offset != -1; // FIXME  
+    return offset != (size_t)-1; // FIXME  
   }
   
   // return the size of the file
-  byte get_size() {
-    return size;
+  uint16_t get_size() {
+    return length;
   }
   
   // return the id of the file
@@ -132,103 +700,311 @@ class microfsfile {
   
   // write byte <value> to position <pos> in the current file
   // if the file is not valid or if <pos> is out of bounds, return false
-  bool write_byte(byte pos, byte value) {
-    if (!is_valid())
+  bool write_byte(uint16_t pos, byte value) {
+    if (!is_valid() || pos >= length)
       return false;
-    size_t off = offset + 2 + pos;
-    return eeprom_update(off, value);
+    return transfer(pos, &value, 1, true) == 1;
   }
   
   // read a byte from position <pos> in the current file
   // if the file is not valid or if <pos> is out of bounds, return 0
-  byte read_byte(byte pos) {
-    if (!is_valid())
-      return 0;
-    size_t off = offset + 2 + pos;
-    return eeprom_read(off);
+  byte read_byte(uint16_t pos) {
+    byte value = 0;
+    if (is_valid() && pos < length)
+      transfer(pos, &value, 1, false);
+    return value;
   }
   
-  byte write_bytes(byte pos, byte* buf, byte len) {
-    if (!is_valid()) {
-      Serial.println(F("!is_valid()"));
+  // write up to <len> bytes from <buf> starting at position <pos> in the current file
+  // the write is clipped at the end of the file; returns the number of bytes written, 0 on error
+  // note: with MICROFS_FILE_CRC every write reads back each chunk it touches to update its CRC,
+  // so write a file with as few calls as possible
+  uint16_t write_bytes(uint16_t pos, const byte* buf, uint16_t len) {
+    if (!is_valid() || pos >= length) {
+      Serial.println(F("write_bytes oob"));
       return 0;
     }
-    if (pos >= size) {
-      Serial.println(F("pos >= size"));
-      Serial.println(pos);
-      Serial.println(size);
+    uint16_t n = transfer(pos, (byte*)buf, len, true);
+    if (n != min(len, (uint16_t)(length-pos)))
+      Serial.println(F("write_bytes fail"));
+    return n;
+  }
+  
+  // read up to <len> bytes into <buf> starting at position <pos> in the current file
+  // the read is clipped at the end of the file; returns the number of bytes read, 0 on error
+  uint16_t read_bytes(uint16_t pos, byte* buf, uint16_t len) {
+    if (!is_valid() || pos >= length) {
+      Serial.println(F("read_bytes oob"));
       return 0;
     }
-    byte i;
-    for (i=0; i<len && pos+i<size; i++) {
-      if (write_byte(pos+i, buf[i]) == false) {
-        Serial.println(F("write_byte fail"));
-        Serial.println(i);
-        Serial.println(pos);
-        Serial.println(size);
-        return 0;
-      }
+    return transfer(pos, buf, len, false);
+  }
+  
+};
+
+#if MICROFS_INDEX_ENTRIES > 0
+// in-RAM copy of the on-disk header chain, sorted by offset
+class microfsindex {
+  
+  template <class> friend class microfs_t;
+  
+  struct entry {
+    byte id;
+    byte size;
+    uint16_t offset;
+  };
+  
+  entry entries[MICROFS_INDEX_ENTRIES];
+  byte count;
+  bool valid; // false if the index is not mounted or has overflowed
+  byte ids[256/8]; // bitmap of the file ids currently on disk (id 0 excluded)
+  
+  microfsindex() : count(0), valid(false) {
+  }
+  
+  void reset() {
+    count = 0;
+    valid = true;
+    memset(ids, 0, sizeof(ids));
+  }
+  
+  bool has_id(byte id) {
+    return ids[id/8] & (((byte)1) << (id%8));
+  }
+  
+  void mark_id(byte id, bool used) {
+    if (id == 0)
+      return;
+    if (used)
+      ids[id/8] |= ((byte)1) << (id%8);
+    else
+      ids[id/8] &= ~(((byte)1) << (id%8));
+  }
+  
+  // position of the first entry with offset >= pos
+  byte lower_bound(size_t pos) {
+    byte lo = 0, hi = count;
+    while (lo < hi) {
+      byte mid = (lo + hi) / 2;
+      if (entries[mid].offset < pos)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
-    return i;
+    return lo;
   }
   
-  byte read_bytes(byte pos, byte* buf, byte len) {
-    if (!is_valid()) {
-      Serial.println(F("!is_valid()"));
-      return 0;
+  // position of the entry describing the header at <pos>, or count if not found
+  byte find_pos(size_t pos) {
+    byte i = lower_bound(pos);
+    return i < count && entries[i].offset == pos ? i : count;
+  }
+  
+  // position of the first entry with id <file_id>, or count if not found
+  byte find_id(byte file_id) {
+    if (file_id != 0 && !has_id(file_id))
+      return count;
+    for (byte i=0; i<count; i++) {
+      if (entries[i].id == file_id)
+        return i;
     }
-    if (pos >= size) {
-      Serial.println(F("pos >= size"));
-      Serial.println(pos);
-      Serial.println(size);
-      return 0;
+    return count;
+  }
+  
+  // record that header <id,size> has been written at <pos>
+  // headers that are swallowed by the new chunk are dropped from the index
+  void update(size_t pos, byte id, byte size) {
+    if (!valid)
+      return;
+    byte i = lower_bound(pos);
+    if (i < count && entries[i].offset == pos) {
+      mark_id(entries[i].id, false);
+    } else {
+      if (count == MICROFS_INDEX_ENTRIES) {
+        // out of RAM budget: fall back to scanning the EEPROM
+        valid = false;
+        return;
+      }
+      memmove(entries+i+1, entries+i, (count-i)*sizeof(entry));
+      count++;
     }
-    byte i;
-    for (i=0; i<len && pos+i<size; i++) {
-      buf[i] = read_byte(pos+i);
+    entries[i].id = id;
+    entries[i].size = size;
+    entries[i].offset = pos;
+    mark_id(id, true);
+    size_t end = pos + MICROFS_HEADER + size;
+    byte j = i + 1;
+    while (j < count && entries[j].offset < end) {
+      mark_id(entries[j].id, false);
+      j++;
     }
-    return i;
+    memmove(entries+i+1, entries+j, (count-j)*sizeof(entry));
+    count -= j - (i + 1);
   }
   
 };
+#endif // MICROFS_INDEX_ENTRIES
+
+// summary of the state of the file system, see microfs::stat()
+struct microfsstats {
+  bool consistent; // see microfs::check_disk()
+  size_t used; // see microfs::used()
+  size_t free; // see microfs::free()
+  size_t total; // see microfs::total()
+  byte files; // see microfs::files()
+  byte max_free_chunk; // see microfs::max_free_chunk()
+  unsigned free_chunks; // see microfs::free_chunks()
+  byte max_file_size; // size of the largest file that can currently be created in a single chunk
+  byte fragmentation; // percentage of free space outside of the largest free chunk
+  unsigned headers; // length of the header chain, i.e. headers visited by a full scan
+};
+
+// allocator counters, scan lengths are measured in headers visited
+struct microfsallocstats {
+  unsigned allocs; // successful allocations
+  unsigned failures; // failed allocations
+  unsigned long scanned; // headers visited by all allocations
+  unsigned last_scan; // headers visited by the last allocation
+  unsigned max_scan; // headers visited by the longest allocation
+};
 
-class microfs {
+template <class storage>
+class microfs_t {
+  
+  typedef microfsfile_t<storage> microfsfile;
   
   const size_t size;
   bool consistent;
+#if MICROFS_INDEX_ENTRIES > 0
+  microfsindex index;
+#endif
+  microfsallocstats stats;
+  
+  // state of the background compaction, see compact()
+  struct compaction_state {
+    bool done; // nothing left to compact until the next create() or remove()
+    bool moving; // a file is being copied from src to dst
+    size_t src; // header of the file being moved
+    size_t dst; // header of the free chunk the file is moved to
+    byte id, size; // file being moved
+    byte dst_size; // size of the free chunk the file is moved to
+    size_t copied; // bytes of data (and CRC) copied so far
+    byte evacuations; // files moved toward the end in this pass
+    unsigned generation; // storage::generation() after the last copy step
+  } compaction;
+  
+  // state of an export or of an import, see export_frame() and import_frame()
+  struct transfer_state {
+    byte next; // type of the next frame, 0 if no transfer is in progress
+    size_t pos; // next byte of storage to be sent or received
+    uint16_t crc; // CRC of the storage bytes sent or received so far
+    unsigned generation; // storage::generation() when the export started
+  } exporting, importing;
+  
+#if MICROFS_FILE_CRC
+  byte verified[256/8]; // ids of the files whose CRC has been checked since mount()
+  byte fsck_id; // next file to be checked by fsck(), 0 once all files have been checked
+  byte fsck_errors; // files with a bad CRC found by fsck()
+#endif
   
   public:
-  microfs() : size(E2END+1) {
+  microfs_t() : size(storage::size()) {
+    memset(&stats, 0, sizeof(stats));
+    memset(&compaction, 0, sizeof(compaction));
+    memset(&exporting, 0, sizeof(exporting));
+    memset(&importing, 0, sizeof(importing));
+  }
+  
+  // load the header chain in the in-RAM index (if enabled)
+  // until mount() is called, or if the index overflows, every lookup scans the EEPROM
+  void mount() {
+    repair();
+    compaction.done = false;
+    compaction.moving = false;
+#if MICROFS_FILE_CRC
+    memset(verified, 0, sizeof(verified));
+    fsck_id = 1;
+    fsck_errors = 0;
+#endif
+#if MICROFS_INDEX_ENTRIES > 0
+    index.reset();
+    size_t pos = 0;
+    while (pos < size && index.valid) {
+      microfsfile f = read_header_raw(pos);
+      index.update(pos, f.id, f.size);
+      pos += f.stride();
+    }
+#endif
+  }
+  
+  // true if lookups are served by the in-RAM index
+  bool indexed() {
+#if MICROFS_INDEX_ENTRIES > 0
+    return index.valid;
+#else
+    return false;
+#endif
   }
   
   void format() {
     size_t pos = 0;
-    while (pos < size) {
-      microfsfile unallocated(0, max(0, min(255, size-pos-2)));
+    while (pos+MICROFS_HEADER <= size) {
+      size_t left = size-pos-MICROFS_HEADER;
+      byte chunk_size = min(left, 255);
+      // less than MICROFS_HEADER bytes can't hold a header: leave room for an empty chunk instead
+      if (left-chunk_size > 0 && left-chunk_size < MICROFS_HEADER)
+        chunk_size -= MICROFS_HEADER - (left-chunk_size);
+      microfsfile unallocated(0, chunk_size);
       write_header(pos, unallocated);
       pos += unallocated.stride();
     }
+    mount();
   }
   
   // true if the disk _appears_ to be in a consistent state
   // note: this is a very poor approximation of a real disk check... it
-  // may very well return true if the data is completely screwed
+  // may very well return true if the data is completely screwed (see fsck())
   bool check_disk() {
+    microfsstats st;
+    stat(&st);
+    return st.consistent;
+  }
+  
+  // fill <st> walking the header chain on the EEPROM once
+  // if the disk is not consistent the walk stops at the first bad header and
+  // the other fields only describe the headers before it
+  void stat(microfsstats* st) {
+    memset(st, 0, sizeof(*st));
+    st->total = size;
+    st->consistent = true;
     size_t pos = 0;
     byte mask[256/8] = {0};
     while (pos < size) {
-      microfsfile f = read_header(pos);
+      microfsfile f = read_header_raw(pos);
       // check that the file is not overflowing
-      if (pos + f.stride() > size)
-        return false;
       // check for duplicate file ids
       byte used = mask[f.id/8] & (((byte)1) << (f.id%8));
-      if (f.id != 0 && used)
-        return false;
+      if (pos + f.stride() > size || (f.id != 0 && f.id != MICROFS_EXTENT && used)) {
+        st->consistent = false;
+        break;
+      }
       mask[f.id/8] |= (((byte)1) << (f.id%8));
+      st->headers++;
+      if (f.id != 0) {
+        st->used += f.size;
+        if (f.id != MICROFS_EXTENT)
+          st->files++;
+      } else {
+        st->free += f.size;
+        st->free_chunks++;
+        st->max_free_chunk = max(st->max_free_chunk, f.size);
+      }
       pos += f.stride();
     }
-    return true;
+    // a chunk can host a file of its same size, so the only other limit is running out of ids
+    st->max_file_size = st->files < 254 ? st->max_free_chunk : 0;
+    if (st->free > 0)
+      st->fragmentation = 100 - (((size_t)st->max_free_chunk) * 100 / st->free);
   }
   
   // amount of space currently used by file data (file headers are not counted: this means 
@@ -258,6 +1034,17 @@ class microfs {
     return free;
   }
   
+  // wait until all the pending writes have reached the EEPROM
+  // returns false if any write failed verification since the last flush
+  bool flush() {
+    return storage::flush();
+  }
+  
+  // allocator counters
+  const microfsallocstats& alloc_stats() {
+    return stats;
+  }
+  
   // size of the whole fs
   size_t total() {
     return size;
@@ -269,7 +1056,7 @@ class microfs {
     byte count = 0;
     while (pos < size) {
       microfsfile f = read_header(pos);
-      if (f.is_valid() && f.id != 0) {
+      if (f.is_valid() && f.id != 0 && f.id != MICROFS_EXTENT) {
         count++;
       }
       pos += f.stride();
@@ -293,9 +1080,9 @@ class microfs {
   
   
   // number of free chunks
-  byte free_chunks() {
+  unsigned free_chunks() {
     size_t pos = 0;
-    byte count = 0;
+    unsigned count = 0;
     while (pos < size) {
       microfsfile f = read_header(pos);
       if (f.is_valid() && f.id == 0) {
@@ -307,27 +1094,46 @@ class microfs {
   }    
   
   // open an existing file with id <file_id>
+  // with MICROFS_FILE_CRC, the invalid file is returned if the file doesn't match its CRC
   microfsfile open(byte file_id) {
-    size_t pos = 0;
-    while (pos < size) {
-      microfsfile f = read_header(pos);
-      if (f.is_valid() && f.id == file_id) {
-        return f;
-      }
-      pos += f.stride();
-    }
+    microfsfile f = find(file_id);
+    if (!f.is_valid() || checked(f))
+      return f;
+    Serial.println(F("bad crc"));
+    Serial.println(file_id);
     return microfsfile();
   }
   
+  // check the CRC of the next file, so that the whole fs is checked a file per call after mount()
+  // returns false once all the files have been checked, see fsck_errors()
+  bool fsck() {
+#if MICROFS_FILE_CRC
+    if (fsck_id == 0 || transferring())
+      return false;
+    microfsfile f = find(fsck_id);
+    if (f.is_valid() && !checked(f))
+      fsck_errors++;
+    fsck_id++;
+    return fsck_id != 0;
+#else
+    return false;
+#endif
+  }
+  
+  // number of files with a bad CRC found by fsck() since mount()
+  byte fsck_errors_found() {
+#if MICROFS_FILE_CRC
+    return fsck_errors;
+#else
+    return 0;
+#endif
+  }
+  
   // allocate and create a new file on disk of size <size>
-  microfsfile create(byte size, byte file_id=0) {
-    microfsfile unallocated = find_alloc(size);
-    if (!unallocated.is_valid()) {
-      Serial.println(F("!unallocated"));
-      Serial.println(size);
+  // files larger than 255 bytes get continuation extents, see resize()
+  microfsfile create(uint16_t size, byte file_id=0) {
+    if (size > MICROFS_MAX_FILE_SIZE || file_id == MICROFS_EXTENT)
       return microfsfile();
-    }
-    
     byte id;
     if (file_id == 0) {
       id = find_id();
@@ -336,141 +1142,735 @@ class microfs {
         return microfsfile();
       }
     } else {
-      if (open(file_id).is_valid()) {
+      if (find(file_id).is_valid()) {
         Serial.println(F("is_valid()!"));
-         microfsfile();
+        return microfsfile();
       }
       id = file_id;
     }
-    microfsfile newfile(id, size);
-    size_t newfile_pos = unallocated.offset;
-    // find_alloc will return either a chunk of size == size or size >= size + 2
-    // in the second case, we write a new unallocated header at the end of the newly allocated file
-    // note: no critical section here!
-    if (unallocated.size > size) {
-      unallocated.size -= newfile.stride();
-      write_header(unallocated.offset+newfile.stride(), unallocated);
-    }
-    return write_header(newfile_pos, newfile);
+    microfsfile newfile = create_chunk(id, min(size, (uint16_t)255));
+    if (!newfile.is_valid() || size <= 255)
+      return newfile;
+    newfile = resize(id, size);
+    if (!newfile.is_valid())
+      remove(id);
+    return newfile;
   }
   
   // remove file <file_id> from disk
   bool remove(byte file_id) {
     // file_id == 0 is unallocated space, can't be removed...
-    if (file_id == 0)
+    if (file_id == 0 || file_id == MICROFS_EXTENT)
       return false;
-    // find the file to be deleted and its immediate neighbors
-    microfsfile prev, cur, next;
-    find_contiguous_files(file_id, &prev, &cur, &next);
-    if (!cur.is_valid())
+    microfsfile f = find(file_id);
+    if (!f.is_valid())
       return false;
-    // check if we can merge the file with one or more of its neighbors
-    size_t new_size, new_pos;
-    if (prev.mergeable() && next.mergeable()) {
-      new_size = ((size_t)prev.size) + cur.stride() + next.stride();
-      new_pos = prev.offset;
-    } else if (prev.mergeable()) {
-      new_size = ((size_t)prev.size) + cur.stride();
-      new_pos = prev.offset;
-    } else if (next.mergeable()) {
-      new_size = ((size_t)cur.size) + next.stride();
-      new_pos = cur.offset;
-    } else {
-      new_size = cur.size;
-      new_pos = cur.offset;
-    }
-    // actually write to disk the changes
-    // FIXME: proceed backwards
-    /* CRITICAL SECTION */ 
-    {
-      while (new_size > 255) {
-        new_pos += write_header(new_pos, microfsfile(0, 255), false).stride();
-        new_size -= 255;
+    // the last extent goes first, so that a power loss leaves a shorter file
+    for (byte seq=microfsfile::extents(f.length); seq>0; seq--)
+      remove_chunk(extent(file_id, seq));
+    unsealed(file_id);
+    return remove_chunk(f);
+  }
+  
+  // change the size of file <file_id> to <new_size> bytes, preserving its contents (up to the new size)
+  // each chunk is resized in place if possible: shrinking splits off the tail as free space, extending
+  // takes space from the free chunk that follows it. otherwise the chunk is moved to a free chunk
+  // that is big enough. The chunks are resized or created from the last one to the first one: an
+  // extent is only part of the file while the chunk before it is full (see find()), so the file 
+  // switches to its new size when the last chunk to change does, and a failure (or a power loss)
+  // before that leaves the file as it was. The extents left past the end of a file that shrank 
+  // are freed last.
+  // returns the resized file, or the invalid file on failure
+  // note: the file may be moved, so handles to it must be reopened
+  microfsfile resize(byte file_id, uint16_t new_size) {
+    if (file_id == 0 || file_id == MICROFS_EXTENT || new_size > MICROFS_MAX_FILE_SIZE)
+      return microfsfile();
+    microfsfile f = find(file_id);
+    if (!f.is_valid())
+      return microfsfile();
+    if (new_size == f.length)
+      return f;
+    byte needed = microfsfile::extents(new_size);
+    for (byte seq=needed; seq>0; seq--) {
+      microfsfile e = extent(file_id, seq);
+      e = e.is_valid() ? resize_chunk(e, extent_size(new_size, seq)) : create_chunk(MICROFS_EXTENT, extent_size(new_size, seq), file_id, seq);
+      if (!e.is_valid()) {
+        resize_undo(f, seq+1, needed);
+        return microfsfile();
       }
-      write_header(new_pos, microfsfile(0, new_size), false);
     }
-    return true;
+    // the first chunk stays full as long as the file has continuation extents
+    microfsfile first = resize_chunk(f, min(new_size, (uint16_t)255));
+    if (!first.is_valid()) {
+      resize_undo(f, 1, needed);
+      return microfsfile();
+    }
+    for (byte seq=microfsfile::extents(f.length); seq>needed; seq--)
+      remove_chunk(extent(file_id, seq));
+    first.length = new_size;
+    return first;
   }
   
-  microfsfile write_file(byte len, byte* data = NULL, byte file_id = 0) {
+  // write a whole file:
+  // file_id == 0 && data == NULL -> allocate a new uninitialized file
+  // file_id != 0 && data == NULL -> truncate/extend (or create) file <file_id>
+  // data != NULL                 -> as above, then overwrite the contents with <data>
+  // returns the file, or the invalid file on failure
+  microfsfile write_file(uint16_t len, const byte* data = NULL, byte file_id = 0) {
     microfsfile f;
     if (file_id == 0) {
       f = create(len);
+    } else if (find(file_id).is_valid()) {
+      f = resize(file_id, len);
     } else {
-      f = open(file_id);
+      f = create(len, file_id);
     }
     if (!f.is_valid())
       return microfsfile();
-      
-    if (data == NULL) {
-      if (file_id == 0) {
-        return create(len);
-      } else {
-        microfsfile f = open(file_id);
-      }
-    } else {
-      if (file_id != 0) {
-        remove(file_id);
+    if (data != NULL && len > 0 && f.write_bytes(0, data, len) != len)
+      return microfsfile();
+    return f;
+  }
+  
+  // copy file <src_id> to file <dst_id>, which is created or resized as needed
+  // the data is moved a block at a time and only the bytes that differ are written, so copying 
+  // over an older copy of the same file is cheap. returns the copy, or the invalid file if the 
+  // source is missing (or doesn't match its CRC) or there is no room for the copy
+  microfsfile copy(byte src_id, byte dst_id) {
+    if (src_id == dst_id)
+      return microfsfile();
+    microfsfile src = open(src_id);
+    if (!src.is_valid())
+      return microfsfile();
+    microfsfile dst = write_file(src.length, NULL, dst_id);
+    if (!dst.is_valid())
+      return microfsfile();
+    // the files have the same size, so their chunks are laid out the same way
+    byte buf[16];
+    for (uint16_t pos=0; pos<src.length; ) {
+      microfsfile sc, dc;
+      byte sat, dat, room;
+      if (!src.locate(pos, &sc, &sat, &room) || !dst.locate(pos, &dc, &dat, &room))
+        return microfsfile();
+      byte n = min(room, (byte)sizeof(buf));
+      storage::read_block(sc.offset + MICROFS_HEADER + sat, buf, n);
+      storage::update_block(dc.offset + MICROFS_HEADER + dat, buf, n);
+      pos += n;
+      // each chunk of the copy is sealed once, when its last byte is in
+      if (n == room)
+        dc.seal();
+    }
+    sealed(dst);
+    return dst;
+  }
+  
+  // exempt file <file_id> from the CRC: its writes no longer update the CRC byte of its chunks, and
+  // open() and fsck() accept it whatever its contents. The file stays exempt when it is moved or 
+  // resized, but the extents added by growing it are checked. Without MICROFS_FILE_CRC this does 
+  // nothing. returns false if the file doesn't exist
+  bool uncheck(byte file_id) {
+    microfsfile f = find(file_id);
+    if (!f.is_valid())
+      return false;
+#if MICROFS_FILE_CRC
+    storage::update(f.offset + 2, MICROFS_NO_CRC);
+    for (byte seq=1; seq<=microfsfile::extents(f.length); seq++)
+      storage::update(extent(file_id, seq).offset + 2, MICROFS_NO_CRC);
+#endif
+    return true;
+  }
+  
+  // run one bounded step of the background compaction, returns false once there is nothing left to do
+  // note: files may be moved, so microfsfile handles must not be kept across calls
+  bool compact() {
+    if (compaction.done)
+      return false;
+    // don't move files under an export or an import
+    if (transferring())
+      return true;
+    // don't stall the caller behind pending writes
+    if (!storage::idle())
+      return true;
+    if (compaction.moving)
+      return compact_move();
+    return compact_plan();
+  }
+  
+  // start sending the whole storage with export_frame()
+  void export_start() {
+    exporting.next = 'S';
+  }
+  
+  // true while an export or an import is in progress
+  bool transferring() {
+    return exporting.next || importing.next;
+  }
+  
+  // write the next line of the export to <line> (MICROFS_FRAME_LINE bytes)
+  // returns false once the export is complete
+  bool export_frame(char* line) {
+    byte frame[MICROFS_FRAME_DATA+5];
+    byte len = 3;
+    if (exporting.next == 'D' && storage::generation() != exporting.generation)
+      exporting.next = 'S'; // the storage changed under the export: start over
+    frame[0] = exporting.next;
+    switch (exporting.next) {
+      case 'S':
+        exporting.pos = 0;
+        exporting.crc = 0xffff;
+        exporting.generation = storage::generation();
+        frame[1] = (uint32_t)size >> 16;
+        frame[2] = size >> 8;
+        frame[3] = size;
+        len = 4;
+        exporting.next = 'D';
+        break;
+      case 'D': {
+        byte n = min(size-exporting.pos, MICROFS_FRAME_DATA);
+        frame[1] = exporting.pos >> 8;
+        frame[2] = exporting.pos;
+        storage::read_block(exporting.pos, frame+3, n);
+        exporting.crc = microfs_crc16(exporting.crc, frame+3, n);
+        exporting.pos += n;
+        len += n;
+        if (exporting.pos >= size)
+          exporting.next = 'E';
+        break;
       }
-      microfsfile f = create(len);
-      f.write_bytes(0, data, len);
+      case 'E':
+        frame[1] = exporting.crc >> 8;
+        frame[2] = exporting.crc;
+        exporting.next = 0;
+        break;
+      default:
+        return false;
     }
-    // file_id != 0 && data == NULL -> truncate/extend
-    // file_id == 0 && data == NULL -> allocate uninitialized
-    // data != NULL                 -> overwrite
+    uint16_t crc = microfs_crc16(0xffff, frame, len);
+    frame[len++] = crc >> 8;
+    frame[len++] = crc;
+    line[0] = ':';
+    microfs_b64_encode(frame, len, line+1);
+    return true;
   }
   
-  void dump() {
-    for (int i=0; i<size; i++) {
-      char buf[3];
-      snprintf(buf, sizeof(buf), "%02x", eeprom_read(i));
-      Serial.print(buf);
+  // write the next line of an export (as produced by export_frame()) to the storage
+  // an 'S' frame (re)starts the import; once the 'E' frame has been checked the fs is mounted 
+  // again and 1 is returned. A corrupted or out of sequence line aborts the import and returns -1:
+  // the storage may then be left half-written until an import completes or the fs is formatted.
+  // Returns 0 while more lines are expected.
+  int import_frame(const char* line) {
+    byte frame[MICROFS_FRAME_DATA+5];
+    if (line[0] != ':')
+      return import_abort();
+    int len = microfs_b64_decode(line+1, frame, sizeof(frame));
+    if (len < 5 || microfs_crc16(0xffff, frame, len-2) != ((uint16_t)frame[len-2] << 8 | frame[len-1]))
+      return import_abort();
+    len -= 2;
+    switch (frame[0]) {
+      case 'S':
+        if (len != 4 || ((uint32_t)frame[1] << 16 | (uint16_t)frame[2] << 8 | frame[3]) != size)
+          return import_abort();
+        importing.next = 'D';
+        importing.pos = 0;
+        importing.crc = 0xffff;
+        return 0;
+      case 'D': {
+        size_t n = len-3;
+        if (importing.next != 'D' || n == 0 || n > size-importing.pos || (size_t)((uint16_t)frame[1] << 8 | frame[2]) != importing.pos)
+          return import_abort();
+        storage::update_block(importing.pos, frame+3, n);
+        importing.crc = microfs_crc16(importing.crc, frame+3, n);
+        importing.pos += n;
+        return 0;
+      }
+      case 'E':
+        if (importing.next != 'D' || importing.pos != size || len != 3 || ((uint16_t)frame[1] << 8 | frame[2]) != importing.crc)
+          return import_abort();
+        importing.next = 0;
+        mount();
+        return 1;
     }
-    Serial.println();
+    return import_abort();
   }
   
   private:
-
-  // find a random chunk of eeprom that can be used to store a file of length <size>
-  // this means either a chunk of size = <size>+2 or a chunk of site >= <size>+2+2
-  microfsfile find_alloc(byte alloc_size) {
-    Serial.println(F("find_alloc"));
-    Serial.println(alloc_size);
+  
+  // size of continuation extent <seq> of a file of <length> bytes
+  static byte extent_size(uint16_t length, byte seq) {
+    uint16_t left = length - 255 - (seq-1) * MICROFS_EXTENT_DATA;
+    return 2 + min(left, (uint16_t)MICROFS_EXTENT_DATA);
+  }
+  
+  // put back extents <from> to <to> of file <f>, changed by a resize() that failed: the extents it
+  // created are freed (from the last one) and the ones it resized get their size back
+  void resize_undo(microfsfile f, byte from, byte to) {
+    byte had = microfsfile::extents(f.length);
+    for (byte seq=to; seq>=from && seq>0; seq--) {
+      microfsfile e = extent(f.id, seq);
+      if (!e.is_valid())
+        continue;
+      if (seq > had)
+        remove_chunk(e);
+      else
+        resize_chunk(e, extent_size(f.length, seq));
+    }
+  }
+  
+  int import_abort() {
+    // the index may not match what has been written so far
+    if (importing.next && importing.pos > 0)
+      mount();
+    importing.next = 0;
+    return -1;
+  }
+  
+  // true if a file of size <file_size> can be placed in the free chunk <f>
+  static bool fits(microfsfile f, byte file_size) {
+    return f.size == file_size || ((size_t)f.size) >= ((size_t)file_size) + MICROFS_HEADER;
+  }
+  
+  // find the next thing to do for compact(): merge two free chunks, or start moving a file
+  bool compact_plan() {
     size_t pos = 0;
-    size_t start_pos = rand() % size;
-    start_pos = 0;
-    // try to find a free chunk after a random start_pos (wrapping around, if needed)
     while (pos < size) {
       microfsfile f = read_header(pos);
-      size_t alloc_size_plus_2 = ((size_t)alloc_size)+((size_t)2);
-      if (pos >= start_pos && f.is_valid() && f.id == 0 && (f.size == alloc_size || f.size >= alloc_size_plus_2)) {
-        return f;
+      size_t next_pos = pos + f.stride();
+      if (f.id != 0 || next_pos >= size) {
+        pos = next_pos;
+        continue;
+      }
+      microfsfile next = read_header(next_pos);
+      if (next.id == 0) {
+        // two adjacent free chunks: a single header write merges them (or makes the first one full)
+        if (merge_free(f, next))
+          return true;
+        pos = next_pos;
+        continue;
+      }
+      // fill the free chunk with the file after it or, if that's too big, with the later file that fits best
+      if (fits(f, next.size)) {
+        compact_start(next, f);
+        return true;
+      }
+      microfsfile best, last_free;
+      size_t scan = next_pos + next.stride();
+      while (scan < size) {
+        microfsfile g = read_header(scan);
+        if (g.id == 0)
+          last_free = g;
+        else if (fits(f, g.size) && (!best.is_valid() || g.size > best.size))
+          best = g;
+        scan += g.stride();
+      }
+      if (best.is_valid()) {
+        compact_start(best, f);
+        return true;
+      }
+      // move the file after the free chunk to the last free chunk, unless no other file lies 
+      // beyond it (the move wouldn't let free space coalesce); the number of such moves per 
+      // pass is bounded so that compaction always terminates
+      if (last_free.is_valid() && last_free.offset > next_pos + next.stride() && fits(last_free, next.size) && compaction.evacuations < 16) {
+        compaction.evacuations++;
+        compact_start(next, last_free);
+        return true;
+      }
+      pos = next_pos;
+    }
+    compaction.done = true;
+    return false;
+  }
+  
+  // start moving file <f> to the free chunk <dst>
+  void compact_start(microfsfile f, microfsfile dst) {
+    compaction.moving = true;
+    compaction.src = f.offset;
+    compaction.dst = dst.offset;
+    compaction.id = f.id;
+    compaction.size = f.size;
+    compaction.dst_size = dst.size;
+    compaction.copied = 0;
+    compaction.generation = storage::generation();
+  }
+  
+  // copy the next bytes of the file being moved, and switch it over once the copy is complete
+  bool compact_move() {
+    microfsfile src = read_header(compaction.src);
+    microfsfile dst = read_header(compaction.dst);
+    if (src.id != compaction.id || src.size != compaction.size || dst.id != 0 || dst.size != compaction.dst_size) {
+      // the file system changed since the move started: plan again
+      compaction.moving = false;
+      return true;
+    }
+    if (storage::generation() != compaction.generation) {
+      // something was written: the data copied so far may be stale
+      compaction.copied = 0;
+    }
+    // the CRC is copied along with the data, which is what follows it
+    size_t len = MICROFS_HEADER - 2 + compaction.size;
+    byte n = min(MICROFS_COMPACT_STEP, len - compaction.copied);
+    for (byte i=0; i<n; i++) {
+      size_t off = 2 + compaction.copied + i;
+      storage::update(compaction.dst + off, storage::read(compaction.src + off));
+    }
+    compaction.copied += n;
+    compaction.generation = storage::generation();
+    if (compaction.copied < len)
+      return true;
+    compaction.moving = false;
+    commit_copy(src, dst, compaction.size);
+    return true;
+  }
+  
+  // allocate a chunk of <size> bytes for file <id>; continuation extents (id MICROFS_EXTENT) get 
+  // the tag <owner>, <seq> before their header is written
+  microfsfile create_chunk(byte id, byte size, byte owner=0, byte seq=0) {
+    microfsfile unallocated = find_alloc(size);
+    if (!unallocated.is_valid()) {
+      Serial.println(F("!unallocated"));
+      Serial.println(size);
+      return microfsfile();
+    }
+    compaction.done = false;
+    microfsfile newfile(id, size);
+    // the new file is placed <skew> bytes into the chunk: the bytes before it remain unallocated
+    size_t skew = alloc_skew(unallocated, size);
+    size_t newfile_pos = unallocated.offset + skew;
+    byte free_size = unallocated.size - skew;
+    // find_alloc will return either a chunk of size == size or size >= size + MICROFS_HEADER
+    // in the second case, we write a new unallocated header at the end of the newly allocated file
+    // note: no critical section here!
+    if (free_size > size) {
+      write_header(newfile_pos+newfile.stride(), microfsfile(0, free_size - newfile.stride()));
+    }
+    // the tag and the CRC go in while the new file is still free space
+    if (id == MICROFS_EXTENT) {
+      storage::update(newfile_pos + MICROFS_HEADER, owner);
+      storage::update(newfile_pos + MICROFS_HEADER + 1, seq);
+    }
+    microfsfile(id, size, newfile_pos).seal_new();
+    newfile = write_header(newfile_pos, newfile);
+    sealed(newfile);
+    // shrink the unallocated chunk last: until then the new file is hidden inside it
+    if (skew > 0) {
+      write_header(unallocated.offset, microfsfile(0, skew - MICROFS_HEADER));
+    }
+    return newfile;
+  }
+  
+  // free chunk <f>, merging it with the free chunks around it
+  // every step is a single byte update of a header, so a power loss can't break the header chain
+  bool remove_chunk(microfsfile f) {
+    // find the chunk to be freed and its immediate neighbors
+    microfsfile prev, cur, next;
+    find_contiguous(f.offset, &prev, &cur, &next);
+    if (!cur.is_valid() || cur.id == 0)
+      return false;
+    compaction.done = false;
+    compaction.evacuations = 0;
+#if MICROFS_INDEX_ENTRIES > 0
+    // merging chunks reduces the number of headers: try to bring back the index
+    bool remount = !index.valid;
+#endif
+    cur = write_header(cur.offset, microfsfile(0, cur.size), false);
+    // merge the free chunks from prev (or cur) to next (or cur) 
+    size_t pos = prev.is_valid() && prev.id == 0 ? prev.offset : cur.offset;
+    size_t end = next.is_valid() && next.id == 0 ? next.offset + next.stride() : cur.offset + cur.stride();
+    while (true) {
+      microfsfile a = read_header(pos);
+      size_t next_pos = pos + a.stride();
+      if (next_pos >= end)
+        break;
+      if (!merge_free(a, read_header(next_pos))) {
+        pos = next_pos;
+        continue;
+      }
+      // a full chunk can't grow anymore: go on with what follows it
+      a = read_header(pos);
+      if (a.size == 255)
+        pos += a.stride();
+    }
+#if MICROFS_INDEX_ENTRIES > 0
+    if (remount)
+      mount();
+#endif
+    return true;
+  }
+  
+  // merge the adjacent free chunks <f> and <next> or, if they are too big for a single chunk, 
+  // grow <f> to 255 bytes and leave the remainder to <next>. The remainder header is written first 
+  // inside free space, then a single byte update of the size of <f> switches over.
+  // returns false if the chunks can't be merged
+  bool merge_free(microfsfile f, microfsfile next) {
+    size_t total = ((size_t)f.size) + next.stride();
+    if (total <= 255) {
+      write_header(f.offset, microfsfile(0, total));
+      return true;
+    }
+    // no room for the header of the remainder, or it would overlap the one of <next>
+    if (total < 255 + MICROFS_HEADER || f.size > 255 - MICROFS_HEADER)
+      return false;
+    write_header(f.offset + MICROFS_HEADER + 255, microfsfile(0, total - 255 - MICROFS_HEADER));
+    write_header(f.offset, microfsfile(0, 255));
+    return true;
+  }
+  
+  // change the size of chunk <f> to <new_size> bytes, in place if possible, see resize()
+  microfsfile resize_chunk(microfsfile f, byte new_size) {
+    microfsfile prev, cur, next;
+    find_contiguous(f.offset, &prev, &cur, &next);
+    if (!cur.is_valid() || cur.id == 0)
+      return microfsfile();
+    if (new_size == cur.size)
+      return cur;
+    // free space after the file once resized: the chunk after it (if free) plus/minus the difference
+    size_t free_after = next.is_valid() && next.id == 0 ? next.stride() : 0;
+    free_after = free_after + cur.size - new_size;
+    // changing the size by less than a header would put the new free header over the current one
+    byte change = new_size > cur.size ? new_size - cur.size : cur.size - new_size;
+    bool overlaps = change < MICROFS_HEADER;
+    if (free_after <= 255 + MICROFS_HEADER && (free_after == 0 || free_after >= MICROFS_HEADER) && !overlaps) {
+      // the new header of the free space is written inside the area currently covered by the file 
+      // (shrink) or by the free chunk after it (extend), then a single byte update of the file size
+      // switches over
+      microfsfile resized(cur.id, new_size);
+      if (free_after > 0) {
+        write_header(cur.offset + resized.stride(), microfsfile(0, free_after - MICROFS_HEADER));
+      }
+      compaction.done = false;
+      resized = write_header(cur.offset, resized);
+      resized.seal();
+      sealed(resized);
+      return resized;
+    }
+    return relocate(cur, new_size);
+  }
+  
+  // move file <f> to a new free chunk, resizing it to <new_size> bytes
+  microfsfile relocate(microfsfile f, byte new_size) {
+    microfsfile dst = find_alloc(new_size);
+    if (!dst.is_valid())
+      return microfsfile();
+    // the data is copied inside the free chunk, where it is harmless until commit_copy()
+    byte buf[16];
+    byte len = min(f.size, new_size);
+    for (int i=0; i<len; i+=sizeof(buf)) {
+      byte n = min(sizeof(buf), len-i);
+      storage::read_block(f.offset + MICROFS_HEADER + i, buf, n);
+      storage::update_block(dst.offset + MICROFS_HEADER + i, buf, n);
+    }
+    // the new size is part of the CRC: the copy gets its own, unless the file is exempt from it
+    microfsfile(f.id, new_size, dst.offset).seal_new(!f.unchecked());
+    microfsfile copy = commit_copy(f, dst, new_size);
+    sealed(copy);
+    return copy;
+  }
+  
+  // make live the copy of file <src> whose data has been written to the free chunk <dst>, resized 
+  // to <new_size>, then free the original
+  // the remainder of the free chunk gets its own header first (inside free space), then the header
+  // of the copy is written: until its id byte is written the copy is just free space, afterwards
+  // the two files have the same id until the original is freed, and repair() drops the later one
+  microfsfile commit_copy(microfsfile src, microfsfile dst, byte new_size) {
+    microfsfile copy(src.id, new_size);
+    if (dst.size > new_size) {
+      write_header(dst.offset + copy.stride(), microfsfile(0, dst.size - copy.stride()));
+    }
+    copy = write_header(dst.offset, copy);
+    write_header(src.offset, microfsfile(0, src.size));
+#if MICROFS_INDEX_ENTRIES > 0
+    // freeing the original cleared the id in the index, but the copy still uses it
+    index.mark_id(src.id, true);
+#endif
+    compaction.done = false;
+    return copy;
+  }
+  
+  // drop the later of two files with the same id, which is what a power loss while a file is 
+  // being moved by compact() or resize() leaves behind
+  void repair() {
+    size_t pos = 0;
+    byte mask[256/8] = {0};
+    while (pos < size) {
+      microfsfile f = read_header_raw(pos);
+      if (pos + f.stride() > size)
+        return;
+      byte used = mask[f.id/8] & (((byte)1) << (f.id%8));
+      if (f.id != 0 && f.id != MICROFS_EXTENT && used) {
+        Serial.println(F("dropping duplicate"));
+        Serial.println(f.id);
+        storage::update(pos+0, 0);
       }
+      mask[f.id/8] |= (((byte)1) << (f.id%8));
       pos += f.stride();
     }
-    pos = 0;
-    while (pos < start_pos) {
+    repair_extents();
+  }
+  
+  // free the continuation extents that don't belong to a file: the later of two copies of an 
+  // extent (left by a power loss while it was being moved) and the extents that follow a missing
+  // or partial chunk of their file. Freeing an extent can orphan the next one, hence the passes.
+  void repair_extents() {
+    bool dropped = true;
+    while (dropped) {
+      dropped = false;
+      size_t pos = 0;
+      while (pos < size) {
+        microfsfile f = read_header_raw(pos);
+        if (pos + f.stride() > size)
+          return;
+        if (f.id == MICROFS_EXTENT && !extent_owned(f)) {
+          if (extent_leftover(f)) {
+            Serial.println(F("dropping extent"));
+            storage::update(pos+0, 0);
+            dropped = true;
+          } else {
+            // a file with id 255 from before the extents gets a free id; if there is none it is 
+            // left on disk, unreachable, until a file is removed and the fs is mounted again
+            byte id = find_id_raw();
+            Serial.println(F("migrating file 255"));
+            Serial.println(id);
+            if (id != 0)
+              storage::update(pos+0, id);
+          }
+        }
+        pos += f.stride();
+      }
+    }
+  }
+  
+  // true if chunk <f> (with id MICROFS_EXTENT) is tagged with a file that exists: extents are created
+  // after the first chunk of their file and freed before it, so that is the case of every extent
+  // left behind by a power loss, while a file that had id 255 before the extents is untagged
+  bool extent_leftover(microfsfile f) {
+    if (f.size < 2 || f.tag(0) == 0 || f.tag(0) == MICROFS_EXTENT || f.tag(1) == 0)
+      return false;
+    size_t pos = 0;
+    while (pos < size) {
+      microfsfile g = read_header_raw(pos);
+      if (g.id == f.tag(0))
+        return true;
+      pos += g.stride();
+    }
+    return false;
+  }
+  
+  // true if continuation extent <f> is the first copy of its extent and the chunk before it in 
+  // its file is full
+  bool extent_owned(microfsfile f) {
+    if (f.size < 2)
+      return false;
+    byte owner = f.tag(0), seq = f.tag(1);
+    if (owner == 0 || owner == MICROFS_EXTENT || seq == 0)
+      return false;
+    if (microfsfile::find_extent(owner, seq).offset != f.offset)
+      return false;
+    microfsfile before;
+    if (seq == 1) {
+      size_t pos = 0;
+      while (pos < size && !before.is_valid()) {
+        microfsfile g = read_header_raw(pos);
+        if (g.id == owner)
+          before = g;
+        pos += g.stride();
+      }
+    } else {
+      before = microfsfile::find_extent(owner, seq-1);
+    }
+    return before.is_valid() && before.size == 255;
+  }
+  
+  // find a chunk of eeprom that can be used to store a file of length <size>, according to MICROFS_ALLOC
+  // this means either a chunk of size = <size> or a chunk of size >= <size>+MICROFS_HEADER
+  microfsfile find_alloc(byte alloc_size) {
+    Serial.println(F("find_alloc"));
+    Serial.println(alloc_size);
+    size_t alloc_size_plus_header = ((size_t)alloc_size)+((size_t)MICROFS_HEADER);
+#if MICROFS_ALLOC == MICROFS_ALLOC_RANDOM
+    size_t start_pos = rand() % size;
+#else
+    size_t start_pos = 0;
+#endif
+    // found: best candidate so far, wrapped: first fitting chunk before start_pos
+    microfsfile found, wrapped;
+    unsigned scanned = 0;
+    size_t pos = 0;
+    while (pos < size) {
       microfsfile f = read_header(pos);
-      size_t alloc_size_plus_2 = ((size_t)alloc_size)+((size_t)2);
-      if (pos >= start_pos && f.is_valid() && f.id == 0 && (f.size == alloc_size || f.size >= alloc_size_plus_2)) {
-        return f;
+      scanned++;
+      if (f.is_valid() && f.id == 0 && (f.size == alloc_size || f.size >= alloc_size_plus_header)) {
+#if MICROFS_ALLOC == MICROFS_ALLOC_BEST_FIT
+        if (!found.is_valid() || f.size < found.size)
+          found = f;
+        if (f.size == alloc_size)
+          break;
+#else
+        if (pos >= start_pos) {
+          found = f;
+          break;
+        }
+        if (!wrapped.is_valid())
+          wrapped = f;
+#endif
       }
       pos += f.stride();
-    }    
-    Serial.println(F("find_alloc fail"));
-    return microfsfile();    
+    }
+    if (!found.is_valid())
+      found = wrapped;
+    stats.last_scan = scanned;
+    stats.max_scan = max(stats.max_scan, scanned);
+    stats.scanned += scanned;
+    if (!found.is_valid()) {
+      stats.failures++;
+      Serial.println(F("find_alloc fail"));
+      return microfsfile();
+    }
+    stats.allocs++;
+    return found;
+  }
+  
+  // offset at which a file of length <alloc_size> is placed inside the free chunk <f> returned by find_alloc
+  // the skew is either 0 or >= MICROFS_HEADER (room for the header of the leading unallocated chunk) 
+  // and never leaves a gap after the file that is too small for a header
+  size_t alloc_skew(microfsfile f, byte alloc_size) {
+#if MICROFS_ALLOC == MICROFS_ALLOC_RANDOM
+    size_t slack = f.size - alloc_size;
+    size_t skew = rand() % (slack + 1);
+    if (slack - skew > 0 && slack - skew < MICROFS_HEADER)
+      skew -= MICROFS_HEADER - (slack - skew);
+    if (skew > 0 && skew < MICROFS_HEADER)
+      skew = 0;
+    return skew;
+#else
+    (void)f;
+    (void)alloc_size;
+    return 0;
+#endif
   }
   
   // find an unused file id in eeprom
   byte find_id() {
+#if MICROFS_INDEX_ENTRIES > 0
+    if (index.valid) {
+      for (int id=1; id<MICROFS_EXTENT; id++) {
+        if (!index.has_id(id))
+          return id;
+      }
+      return 0;
+    }
+#endif
+    return find_id_raw();
+  }
+  
+  // find an unused file id scanning the EEPROM
+  byte find_id_raw() {
     size_t pos = 0;
     byte mask[256/8] = {0};
     while (pos < size) {
-      microfsfile f = read_header(pos);
+      microfsfile f = read_header_raw(pos);
       mask[f.id/8] |= ((byte)1) << (f.id%8);
       pos += f.stride();
     }
-    for (int id=1; id<256; id++) {
+    for (int id=1; id<MICROFS_EXTENT; id++) {
       byte used = mask[id/8] & (((byte)1) << (id%8));
       if (!used) {
         return id;
@@ -479,13 +1879,102 @@ class microfs {
     return 0;
   }
   
-  void find_contiguous_files(byte file_id, microfsfile *prev, microfsfile *cur, microfsfile *next) {
+  // find the file with id <file_id>, without checking its CRC
+  microfsfile find(byte file_id) {
+    microfsfile f = find_chunk(file_id);
+    // only a full first chunk can be followed by continuation extents
+    if (f.is_valid() && f.size == 255) {
+      for (byte seq=1; seq<=254; seq++) {
+        microfsfile e = extent(file_id, seq);
+        if (!e.is_valid())
+          break;
+        f.length += e.size - 2;
+        if (e.size < 255)
+          break;
+      }
+    }
+    return f;
+  }
+  
+  // continuation extent <seq> of file <owner>, using the in-RAM index if possible
+  microfsfile extent(byte owner, byte seq) {
+#if MICROFS_INDEX_ENTRIES > 0
+    if (index.valid) {
+      for (byte i=0; i<index.count; i++) {
+        microfsfile e(index.entries[i].id, index.entries[i].size, index.entries[i].offset);
+        if (e.id == MICROFS_EXTENT && e.size >= 2 && e.tag(0) == owner && e.tag(1) == seq)
+          return e;
+      }
+      return microfsfile();
+    }
+#endif
+    return microfsfile::find_extent(owner, seq);
+  }
+  
+  // find the first chunk of file <file_id>
+  microfsfile find_chunk(byte file_id) {
+    if (file_id == 0 || file_id == MICROFS_EXTENT)
+      return microfsfile();
+#if MICROFS_INDEX_ENTRIES > 0
+    if (index.valid) {
+      byte i = index.find_id(file_id);
+      if (i == index.count)
+        return microfsfile();
+      return microfsfile(index.entries[i].id, index.entries[i].size, index.entries[i].offset);
+    }
+#endif
+    size_t pos = 0;
+    while (pos < size) {
+      microfsfile f = read_header(pos);
+      if (f.is_valid() && f.id == file_id) {
+        return f;
+      }
+      pos += f.stride();
+    }
+    return microfsfile();
+  }
+  
+  // true if file <f> matches its CRC, which is checked only the first time after mount()
+  bool checked(microfsfile f) {
+#if MICROFS_FILE_CRC
+    byte bit = ((byte)1) << (f.id%8);
+    if (verified[f.id/8] & bit)
+      return true;
+    if (!f.verify())
+      return false;
+    verified[f.id/8] |= bit;
+#else
+    (void)f;
+#endif
+    return true;
+  }
+  
+  // mark file <f> as matching its CRC, once it has been written with it
+  void sealed(microfsfile f) {
+#if MICROFS_FILE_CRC
+    verified[f.id/8] |= ((byte)1) << (f.id%8);
+#else
+    (void)f;
+#endif
+  }
+  
+  // forget that file <file_id> matched its CRC
+  void unsealed(byte file_id) {
+#if MICROFS_FILE_CRC
+    verified[file_id/8] &= ~(((byte)1) << (file_id%8));
+#else
+    (void)file_id;
+#endif
+  }
+  
+  // find the chunk at <offset> and its neighbors
+  void find_contiguous(size_t offset, microfsfile *prev, microfsfile *cur, microfsfile *next) {
     size_t pos = 0;
     microfsfile prev_f = microfsfile();
     *prev = *cur = *next = microfsfile();
     while (pos < size) {
       microfsfile f = read_header(pos);
-      if (f.is_valid() && f.id == file_id) {
+      if (f.is_valid() && pos == offset) {
         *cur = f;
         *prev = prev_f;
         *next = read_header(pos + f.stride());
@@ -496,35 +1985,59 @@ class microfs {
     }    
   }
   
-  // read and interpret the two bytes at pos+0 and pos+1 in EEPROM as a file header
+  // interpret the header at pos as a file header, using the in-RAM index if possible
   // note: no check is performed about pos pointing to an actual file header!
   microfsfile read_header(size_t pos) {
-    if (pos < 0 || pos+2 > size)
+#if MICROFS_INDEX_ENTRIES > 0
+    if (index.valid) {
+      byte i = index.find_pos(pos);
+      if (i != index.count)
+        return microfsfile(index.entries[i].id, index.entries[i].size, pos);
+    }
+#endif
+    return read_header_raw(pos);
+  }
+  
+  // read and interpret the two bytes at pos+0 and pos+1 in EEPROM as a file header
+  // note: no check is performed about pos pointing to an actual file header!
+  microfsfile read_header_raw(size_t pos) {
+    if (pos+MICROFS_HEADER > size)
       return microfsfile();
-    byte file_id = eeprom_read(pos+0);  
-    byte file_size = eeprom_read(pos+1);  
+    byte file_id = storage::read(pos+0);  
+    byte file_size = storage::read(pos+1);  
     return microfsfile(file_id, file_size, pos);
   }
   
   microfsfile write_header(size_t pos, microfsfile f, boolean backward=true) {
-    if (pos < 0 || pos+2 > size)
+    if (pos+MICROFS_HEADER > size)
       return f;
+    // the chain changes: the free chunk a move is copying to may not be there anymore (e.g. merged
+    // into the one before it, so that the chain no longer reaches its header), plan it again
+    compaction.moving = false;
     /* CRITICAL SECTION */ 
     {
       if (backward) {
-        eeprom_update(pos+1, f.size);
-        eeprom_update(pos+0, f.id);
+        storage::update(pos+1, f.size);
+        storage::update(pos+0, f.id);
       } else {
-        eeprom_update(pos+0, f.id);
-        eeprom_update(pos+1, f.size);
+        storage::update(pos+0, f.id);
+        storage::update(pos+1, f.size);
       }
     }
+#if MICROFS_INDEX_ENTRIES > 0
+    index.update(pos, f.id, f.size);
+#endif
     f.offset = pos;
     return f;
   }
   
 };
 
+#ifdef __AVR__
+typedef microfs_t<microfs_eeprom> microfs;
+typedef microfsfile_t<microfs_eeprom> microfsfile;
+
 microfs fs;
+#endif
 
 #endif // MICROFS
@@ -1,5 +1,47 @@
 #include "microfs.h"
 
+// an export is being sent over Serial, see start_fs_export()
+static bool fs_exporting = false;
+// line of an import being received over Serial
+static char fs_line[MICROFS_FRAME_LINE];
+static byte fs_line_len = 0;
+
 static void setup_fs() {
+  fs.mount();
+}
+
+// send the contents of the file system over Serial, a line per call to poll_fs()
+static void start_fs_export() {
+  fs.export_start();
+  fs_exporting = true;
 }
 
+// send the next line of an export and restore the lines of an import received on Serial
+// never waits for Serial: a line is sent only if it fits in the transmit buffer
+static void poll_fs() {
+  if (fs_exporting && Serial.availableForWrite() >= MICROFS_FRAME_LINE+1) {
+    char line[MICROFS_FRAME_LINE];
+    fs_exporting = fs.export_frame(line);
+    if (fs_exporting)
+      Serial.println(line);
+  }
+  for (byte n = Serial.available(); n > 0; n--) {
+    char c = Serial.read();
+    if (c == '\r')
+      continue;
+    if (c != '\n') {
+      // overlong lines are truncated, and rejected by import_frame()
+      if (fs_line_len < sizeof(fs_line)-1)
+        fs_line[fs_line_len++] = c;
+      continue;
+    }
+    fs_line[fs_line_len] = 0;
+    if (fs_line[0] == ':') {
+      switch (fs.import_frame(fs_line)) {
+        case 1:  Serial.println(F("import done")); break;
+        case -1: Serial.println(F("import failed")); break;
+      }
+    }
+    fs_line_len = 0;
+  }
+}
@@ -0,0 +1,124 @@
+/*
+  MicroFS on the host
+  Builds microfs with a regular C++ compiler (e.g. on Linux) so that the file system can be run,
+  inspected and benchmarked at full speed, either on a RAM buffer (microfs_ram) or on a memory
+  mapped file (microfs_mmap):
+
+    #include "microfs_host.h"
+
+    typedef microfs_t<microfs_mmap> hostfs;
+
+    microfs_mmap::open("eeprom.bin", 1024);
+    hostfs fs;
+    fs.mount();
+    ...
+    microfs_mmap::close();
+
+  Only the few Arduino definitions used by microfs are provided; the debug output that microfs
+  sends to Serial is discarded.
+*/
+
+#ifndef MICROFS_HOST
+#define MICROFS_HOST
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(str) (str)
+
+template <class A, class B> static inline A min(A a, B b) { return a < (A)b ? a : (A)b; }
+template <class A, class B> static inline A max(A a, B b) { return a > (A)b ? a : (A)b; }
+
+class microfs_host_serial {
+  public:
+  template <class T> void print(T) {}
+  template <class T> void println(T) {}
+  void println() {}
+};
+
+static microfs_host_serial Serial;
+
+#include "microfs.h"
+
+// a file mapped in memory, see open()
+class microfs_mmap {
+  static byte*& data() { static byte* d = NULL; return d; }
+  static size_t& length() { static size_t l = 0; return l; }
+  static unsigned& writes() { static unsigned w = 0; return w; }
+  public:
+  // map the first <len> bytes of file <path>, creating it (zero-filled) if needed
+  // <len> must not exceed 64KB
+  static bool open(const char* path, size_t len) {
+    close();
+    int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return false;
+    if (ftruncate(fd, len) != 0) {
+      ::close(fd);
+      return false;
+    }
+    void* ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+      return false;
+    data() = (byte*)ptr;
+    length() = len;
+    return true;
+  }
+  static void close() {
+    if (data() != NULL) {
+      flush();
+      munmap(data(), length());
+    }
+    data() = NULL;
+    length() = 0;
+  }
+  static size_t size() {
+    return length();
+  }
+  static byte read(size_t pos) {
+    return pos < length() ? data()[pos] : 0;
+  }
+  static bool update(size_t pos, byte val) {
+    if (pos >= length())
+      return false;
+    if (data()[pos] != val) {
+      data()[pos] = val;
+      writes()++;
+    }
+    return true;
+  }
+  static bool read_block(size_t pos, byte* buf, size_t len) {
+    if (pos > length() || len > length()-pos)
+      return false;
+    memcpy(buf, data()+pos, len);
+    return true;
+  }
+  static bool update_block(size_t pos, const byte* buf, size_t len) {
+    if (pos > length() || len > length()-pos)
+      return false;
+    for (size_t i=0; i<len; i++)
+      update(pos+i, buf[i]);
+    return true;
+  }
+  static bool flush() {
+    return data() == NULL || msync(data(), length(), MS_SYNC) == 0;
+  }
+  static bool idle() {
+    return true;
+  }
+  static unsigned generation() {
+    return writes();
+  }
+};
+
+#endif // MICROFS_HOST
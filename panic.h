@@ -8,7 +8,8 @@
   clear_display(); \
   printAt_P(0, 0, msg); \
   printAt_P(0, 1, __FILE__); \
-  printfAt_P(11, 1, " %4d", __LINE__); \
+  printUintAt<5, ' '>(11, 1, __LINE__); \
+  while (!flush_display()); \
   while (halt); \
   reset(); \
 }
@@ -8,25 +8,138 @@ class Step {
   Step() : duration(0), constant(true), temperature(0) {}
 };
 
+#ifndef PROGRAM_MAX_STEPS
+// steps held by a program buffer, longer programs can't be loaded (and are not saved over) or
+// created
+#define PROGRAM_MAX_STEPS 32
+#endif
+
+#ifndef PROGRAM_STARTS_EVERY
+// the start table keeps the start of one step out of this many, see Program::starts()
+#define PROGRAM_STARTS_EVERY 8
+#endif
+
+#ifndef PROGRAM_BUFFERS
+// programs that can be loaded at the same time
+#define PROGRAM_BUFFERS 2
+#endif
+
+// program steps live in a fixed pool instead of the heap, so that loading and editing programs
+// can't fragment it
+static Step program_buffers[PROGRAM_BUFFERS][PROGRAM_MAX_STEPS];
+static byte program_buffers_used = 0; // a bit per buffer
+// what Program::getStep() returns for a step that does not exist
+static Step program_no_step;
+// minute every PROGRAM_STARTS_EVERY-th step of the program in the buffer starts at, then its
+// duration; see Program::starts()
+static uint16_t program_buffer_starts[PROGRAM_BUFFERS][PROGRAM_MAX_STEPS/PROGRAM_STARTS_EVERY+2];
+
+static byte* program_buffer_get() {
+  for (byte i=0; i<PROGRAM_BUFFERS; i++) {
+    if ((program_buffers_used & _BV(i)) == 0) {
+      program_buffers_used |= _BV(i);
+      return (byte*)program_buffers[i];
+    }
+  }
+  Serial.println(F("no program buffer"));
+  return NULL;
+}
+
+static uint16_t* program_buffer_table(byte* ptr) {
+  for (byte i=0; i<PROGRAM_BUFFERS; i++) {
+    if (ptr == (byte*)program_buffers[i])
+      return program_buffer_starts[i];
+  }
+  return NULL;
+}
+
+static void program_buffer_put(byte* ptr) {
+  for (byte i=0; i<PROGRAM_BUFFERS; i++) {
+    if (ptr == (byte*)program_buffers[i])
+      program_buffers_used &= ~_BV(i);
+  }
+}
+
 class Program {
   
   byte file_id;
   byte *ptr;
-  byte size;
+  uint16_t size;
+  bool starts_valid; // the start table matches the durations of the steps
+  byte cursor; // step found by the last getStepAt()
+  uint16_t cursor_start; // minute it starts at
+  bool failed; // the file exists but could not be loaded, it must not be overwritten
+  
+  // the start table, built when the durations have changed: entry k is the minute step
+  // k*PROGRAM_STARTS_EVERY starts at, entry starts_end() is the duration of the program. Keeping
+  // every step would take 2 bytes of RAM per step
+  uint16_t* starts() {
+    uint16_t *table = program_buffer_table(ptr);
+    if (!starts_valid && table != NULL) {
+      uint16_t minutes = 0;
+      for (byte i=0; i<steps(); i++) {
+        if (i % PROGRAM_STARTS_EVERY == 0)
+          table[i / PROGRAM_STARTS_EVERY] = minutes;
+        minutes += getDuration(i);
+      }
+      table[starts_end()] = minutes;
+      starts_valid = true;
+      cursor = 0;
+      cursor_start = 0;
+    }
+    return table;
+  }
+  
+  byte starts_end() {
+    return (steps() + PROGRAM_STARTS_EVERY - 1) / PROGRAM_STARTS_EVERY;
+  }
   
   public:
-  Program(byte file_id=0) : file_id(file_id), ptr(NULL), size(0) {
+  Program(byte file_id=0) : file_id(0), ptr(NULL), size(0), starts_valid(false), cursor(0), cursor_start(0), failed(false) {
+    load(file_id);
+  }
+  
+  Program(const Program& other) : file_id(other.file_id), ptr(NULL), size(0), starts_valid(false), cursor(0), cursor_start(0), failed(true) {
+    if (!other.failed && alloc(other.size)) {
+      memcpy(ptr, other.ptr, size);
+      failed = false;
+    }
+  }
+  
+  // a Program owns its buffer, a copy gets its own from the pool: assigning would have to swap
+  // the buffers (or leak or double free one)
+  Program& operator=(const Program&) = delete;
+  
+  ~Program() {
+    Serial.print(F("~Program "));
+    Serial.println(file_id);
+    program_buffer_put(ptr);
+    ptr = NULL;
+  }
+  
+  // replace the steps with those of file <file_id>
+  void load(byte file_id) {
     Serial.print(F("Program "));
     Serial.println(file_id);
+    this->file_id = file_id;
+    size = 0;
+    starts_valid = false;
+    failed = false;
     microfsfile f = fs.open(file_id);
     if (f.is_valid() && file_id != 0) {
       Serial.println(F("loading program"));
       Serial.println(f.get_size());
-      alloc(f.get_size());
-      byte read = f.read_bytes(0, ptr, f.get_size());
+      if (!alloc(f.get_size())) {
+        failed = true;
+        return;
+      }
+      uint16_t read = f.read_bytes(0, ptr, f.get_size());
       if (read != f.get_size()) {
         Serial.println(F("error reading program"));
         Serial.println(read);
+        size = 0;
+        failed = true;
+        return;
       }
       for (int i=0; i<steps(); i++) {
         Serial.println(i);
@@ -37,34 +150,21 @@ class Program {
     }
   }
   
-  Program(const Program& other) : file_id(other.file_id) {
-    alloc(other.size);
-    memcpy(ptr, other.ptr, size);
-  }
-  
-  ~Program() {
-    Serial.print(F("~Program "));
-    Serial.println(file_id);
-    if (ptr != NULL) {
-      free(ptr);
-      ptr = NULL;
-    }
-  }
-  
   bool is_valid() {
     microfsfile f = fs.open(file_id);
-    return f.is_valid() && file_id != 0;
+    return f.is_valid() && file_id != 0 && !failed;
   }
   
   byte id() {
     return file_id;
   }
   
-  bool alloc(byte size) {
-    byte *newptr = (byte*)realloc(ptr, size);
-    if (newptr != NULL) {
+  bool alloc(uint16_t size) {
+    if (ptr == NULL)
+      ptr = program_buffer_get();
+    if (ptr != NULL && size <= sizeof(program_buffers[0])) {
       this->size = size;
-      ptr = newptr;
+      starts_valid = false;
       return true;
     }
     Serial.println(F("alloc() fail"));
@@ -75,23 +175,20 @@ class Program {
     Serial.println(F("saveChanges"));
     Serial.println(file_id);
     Serial.println(size);
-    fs.remove(file_id);
-    Serial.println(F("saveChanges-create"));
-    microfsfile f = fs.create(size, file_id);
+    if (failed) {
+      // saving would replace the file with the few steps that were loaded, if any
+      Serial.println(F("program not loaded"));
+      return false;
+    }
+    // resize the file (in place if possible) and rewrite only the bytes that changed
+    microfsfile f = fs.write_file(size, ptr, file_id);
     if (!f.is_valid()) {
-      Serial.println(F("could not create file"));
+      Serial.println(F("could not save file"));
       return false;
     }
     Serial.println(f.get_id());
     Serial.println(f.get_size());
     Serial.println(f.get_offset());
-    Serial.println(F("saveChanges-write"));
-    byte len = f.write_bytes(0, ptr, size);
-    if (len != size) {
-      Serial.println(F("error writing file"));
-      Serial.println(len);
-      Serial.println(size);
-    }
     return true;
   }
   
@@ -100,15 +197,12 @@ class Program {
   }
   
   int duration() {
-    int minutes = 0;
-    for (int i=0; i<steps(); i++) {
-      minutes += getDuration(i);
-    }
-    return minutes;
+    uint16_t *table = starts();
+    return table != NULL ? table[starts_end()] : 0;
   }
   
   bool addStep(byte pos) {
-    if (size >= 254)
+    if (steps() >= PROGRAM_MAX_STEPS)
       return false;
     if (pos > steps())
       return false;
@@ -146,6 +240,9 @@ class Program {
       Serial.println("pos >= steps()");
       Serial.println(pos);
       Serial.println(steps());
+      // reads get an empty step, writes are lost instead of landing past the buffer
+      program_no_step = Step();
+      return program_no_step;
     }
     return ((Step*)ptr)[pos];
   }
@@ -157,6 +254,7 @@ class Program {
   void setDuration(byte pos, byte duration) {
     Serial.println(F("setDuration"));
     getStep(pos).duration = duration;
+    starts_valid = false;
   }
   
   byte getTemperature(byte pos) {
@@ -177,15 +275,37 @@ class Program {
     getStep(pos).constant = !!method;
   }
   
+  // the step running at <minute>, 0 if the program is not running then
   byte getStepAt(int minute) {
-    for (int i=0, minutes=0; i<steps(); i++) {
-      int stepDuration = getDuration(i);
-      if (minute < minutes + stepDuration) {
-        return i;
+    uint16_t *table = starts();
+    if (table == NULL || minute < 0 || minute >= table[starts_end()])
+      return 0; // FIXME
+    // while the program runs the minute only moves forward, so it is in the step found last time
+    // or in the next one
+    if (cursor_start <= minute) {
+      uint16_t end = cursor_start + getDuration(cursor);
+      if (minute < end)
+        return cursor;
+      if (cursor+1 < steps() && minute < end + getDuration(cursor+1)) {
+        cursor_start = end;
+        return ++cursor;
       }
-      minutes += stepDuration;
     }
-    return 0; // FIXME
+    // otherwise look for the last table entry that starts at or before <minute>, then walk the
+    // steps from there
+    byte lo = 0, hi = starts_end()-1;
+    while (lo < hi) {
+      byte mid = (lo + hi + 1) / 2;
+      if (table[mid] <= minute)
+        lo = mid;
+      else
+        hi = mid-1;
+    }
+    cursor = lo * PROGRAM_STARTS_EVERY;
+    cursor_start = table[lo];
+    while (minute >= cursor_start + getDuration(cursor))
+      cursor_start += getDuration(cursor++);
+    return cursor;
   }
   
   byte getTemperatureAt(int minute) {
@@ -195,21 +315,17 @@ class Program {
     byte stepIndex = getStepAt(minute);
     if (getMethod(stepIndex) == 0) {
       byte t1 = stepIndex == 0 ? 20 : getTemperature(stepIndex-1);
-      int stepMinute = minute;
-      for (int i = 0; i < stepIndex; i++) {
-        stepMinute -= getDuration(i);
-      }
+      int stepMinute = minute - cursor_start; // getStepAt() left the cursor on the step
       return interpolate(t1, getTemperature(stepIndex), stepMinute, getDuration(stepIndex));
     } else {
       return getTemperature(stepIndex);
     }
   }
   
+  // the temperature <minute> minutes into a ramp from t1 to t2 lasting <duration> minutes, rounded
+  // down; minute < duration <= 255 so the products fit in an int
   static byte interpolate(byte t1, byte t2, int minute, int duration) {
-    float dt = ((float)t2) - ((float)t1);
-    float progress = ((float)minute) / ((float)duration);
-    float t = ((float)t1) + dt * progress;
-    return t;
+    return (t1 * duration + (t2 - t1) * minute) / duration;
   }
   
 };
@@ -133,9 +133,19 @@ static byte get_flame_level() {
 static void setup_safety() {
   wdt_disable();
   wdt_enable(WDTO_250MS);
-  // the safety_control routine is called every 50ms
-  FlexiTimer2::set(safety_control_interval, safety_control);
+  // the timer scans the keypad every keypad_scan_interval ms and calls the safety_control 
+  // routine every safety_control_interval ms (50ms)
+  FlexiTimer2::set(keypad_scan_interval, timer_tick);
   FlexiTimer2::start();
 }
 
+static void timer_tick() {
+  static byte ticks = 0;
+  keypad_scan();
+  if (++ticks >= safety_control_interval / keypad_scan_interval) {
+    ticks = 0;
+    safety_control();
+  }
+}
+
 
@@ -0,0 +1,144 @@
+/*
+  display_bench
+  Compares the number formatters of display_utils.h (printUintAt(), printIntAt()) with the
+  printfAt_P() path they replaced: copy the format string out of flash, vsnprintf() it into a
+  line buffer and print the buffer. Each case draws the same field into the shadow buffer, and
+  the output of both paths is checked against snprintf() first.
+
+    g++ -O2 -I.. -Iui_host -o display_bench display_bench.cpp
+    ./display_bench
+
+  The times are those of the host: ns per field, and TSC cycles on x86. Running it on the AVR
+  would take a port of the harness to the sketch.
+*/
+
+#include <Arduino.h>
+#include <LiquidCrystal.h>
+#include <stdarg.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+LiquidCrystal lcd(0, 0, 0, 0, 0, 0);
+
+#include "custom_chars.h"
+#include "display_utils.h"
+
+// fields drawn for each measure
+#define BENCH_FIELDS 1000000
+
+// the printfAt_P() path, as it was before display_utils.h had the number formatters
+static void old_printAt(byte x, byte y, char *data) {
+  while (*data != '\0' && x < LCD_COLS)
+    writeAt(x++, y, *data++);
+}
+
+static void old_printfAt(byte x, byte y, char *fmt, ...) {
+  const int max_len = 20;
+  char buf[max_len+1];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, max_len+1, fmt, args);
+  va_end(args);
+  old_printAt(x, y, buf);
+}
+
+#define old_printfAt_P(x, y, fmt, ...) {      \
+  char __buf__[sizeof(fmt)+1];                \
+  strcpy_P(__buf__, PSTR(fmt));               \
+  old_printfAt(x, y, __buf__, __VA_ARGS__);   \
+}
+
+// the fields drawn by the sketch, as a printf format and as a formatter call
+struct bench_case {
+  const char *name;
+  const char *format;
+  void (*old_draw)(int value);
+  void (*new_draw)(int value);
+};
+
+static void old_03u(int value) { old_printfAt_P(0, 0, "%03u", value); }
+static void new_03u(int value) { printUintAt<3, '0'>(0, 0, value); }
+static void old_3d(int value) { old_printfAt_P(0, 0, "%3d", value); }
+static void new_3d(int value) { printIntAt<3, ' '>(0, 0, value); }
+static void old_02d(int value) { old_printfAt_P(0, 0, "%02d", value); }
+static void new_02d(int value) { printIntAt<2, '0'>(0, 0, value); }
+
+static const bench_case cases[] = {
+  { "%03u", "%03u", old_03u, new_03u },
+  { "%3d", "%3d", old_3d, new_3d },
+  { "%02d", "%02d", old_02d, new_02d },
+};
+
+// what row 0 shows, without the blank cells at the end
+static void row0(char *out) {
+  byte len = LCD_COLS;
+  while (len > 0 && lcd_buffer[0][len-1] == ' ')
+    len--;
+  memcpy(out, lcd_buffer[0], len);
+  out[len] = '\0';
+}
+
+static void clear_row0() {
+  memset(lcd_buffer[0], ' ', LCD_COLS);
+}
+
+// false if either path draws <value> differently from snprintf()
+static bool check(const bench_case& c, int value) {
+  char expected[LCD_COLS+1], got[LCD_COLS+1];
+  snprintf(expected, sizeof(expected), c.format, value);
+  void (*draws[2])(int) = { c.old_draw, c.new_draw };
+  for (byte i=0; i<2; i++) {
+    clear_row0();
+    draws[i](value);
+    row0(got);
+    if (strcmp(expected, got) != 0) {
+      printf("%s %s of %d: \"%s\" instead of \"%s\"\n", c.name, i == 0 ? "printfAt_P" : "formatter",
+        value, got, expected);
+      return false;
+    }
+  }
+  return true;
+}
+
+static unsigned long long cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// draw BENCH_FIELDS fields with <draw>, print the time per field
+static void measure(const char *name, void (*draw)(int)) {
+  clock_t start = clock();
+  unsigned long long start_cycles = cycles();
+  for (long i=0; i<BENCH_FIELDS; i++)
+    draw(i % 1000);
+  unsigned long long total_cycles = cycles() - start_cycles;
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  printf("  %-10s %8.1f ns", name, seconds * 1e9 / BENCH_FIELDS);
+  if (total_cycles != 0)
+    printf(" %8.1f cycles", (double)total_cycles / BENCH_FIELDS);
+  printf("\n");
+}
+
+int main() {
+  bool ok = true;
+  for (byte i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+    for (int value=-99; value<=1000; value++) {
+      // "%03u" only draws unsigned values
+      if (value >= 0 || cases[i].format[strlen(cases[i].format)-1] != 'u')
+        ok = check(cases[i], value) && ok;
+    }
+  }
+  if (!ok)
+    return 1;
+  for (byte i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+    printf("%s\n", cases[i].name);
+    measure("printfAt_P", cases[i].old_draw);
+    measure("formatter", cases[i].new_draw);
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+/*
+  microfs_bench
+  Measures how fast a file is written and read back on a RAM storage, with the block calls
+  (write_bytes()/read_bytes()) and a byte at a time (write_byte()/read_byte(), the per-byte loop 
+  the block calls replaced). Besides the bytes/sec on the host, it counts the storage accesses
+  per byte of file, and estimates the bytes/sec on the AVR EEPROM from them: there, each cell
+  actually written takes ~3.4ms and dominates everything else.
+
+    g++ -O2 -I.. -o microfs_bench microfs_bench.cpp
+    ./microfs_bench
+
+  Build with the same MICROFS_FILE_CRC setting as the sketch: with it, each write also updates
+  the CRC of the chunks it touches, which the byte at a time path does once per byte.
+*/
+
+#include "microfs_host.h"
+
+#include <time.h>
+
+// passes over the file for each measure
+#define BENCH_PASSES 2000
+// time taken by the AVR to write and to read an EEPROM cell (us)
+#define BENCH_AVR_WRITE_US 3400.0
+#define BENCH_AVR_READ_US 1.0
+
+typedef microfs_ram<2048> ram;
+
+// microfs_ram, counting the bytes read and written
+class counting {
+  public:
+  static unsigned long reads, writes;
+  static size_t size() {
+    return ram::size();
+  }
+  static byte read(size_t pos) {
+    reads++;
+    return ram::read(pos);
+  }
+  static bool update(size_t pos, byte val) {
+    reads++;
+    if (ram::read(pos) != val)
+      writes++;
+    return ram::update(pos, val);
+  }
+  static bool read_block(size_t pos, byte* buf, size_t len) {
+    reads += len;
+    return ram::read_block(pos, buf, len);
+  }
+  static bool update_block(size_t pos, const byte* buf, size_t len) {
+    for (size_t i=0; i<len; i++)
+      update(pos+i, buf[i]);
+    return true;
+  }
+  static bool flush() {
+    return ram::flush();
+  }
+  static bool idle() {
+    return ram::idle();
+  }
+  static unsigned generation() {
+    return ram::generation();
+  }
+};
+
+unsigned long counting::reads = 0;
+unsigned long counting::writes = 0;
+
+typedef microfs_t<counting> benchfs;
+typedef microfsfile_t<counting> benchfile;
+
+// write (or read) file <id> BENCH_PASSES times, a block or a byte at a time
+static void measure(benchfs& fs, byte id, bool write, bool block) {
+  benchfile f = fs.open(id);
+  uint16_t len = f.get_size();
+  byte buf[MICROFS_MAX_FILE_SIZE > 1024 ? 1024 : MICROFS_MAX_FILE_SIZE];
+  counting::reads = counting::writes = 0;
+  clock_t start = clock();
+  for (int pass=0; pass<BENCH_PASSES; pass++) {
+    // every pass writes different contents, so that the cells are actually written
+    for (uint16_t i=0; write && i<len; i++)
+      buf[i] = pass + i;
+    if (block && write)
+      f.write_bytes(0, buf, len);
+    else if (block)
+      f.read_bytes(0, buf, len);
+    for (uint16_t i=0; !block && i<len; i++) {
+      if (write)
+        f.write_byte(i, buf[i]);
+      else
+        buf[i] = f.read_byte(i);
+    }
+  }
+  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+  double bytes = (double)len * BENCH_PASSES;
+  double avr_us = counting::writes * BENCH_AVR_WRITE_US + counting::reads * BENCH_AVR_READ_US;
+  printf("%4u bytes %-5s %-6s %12.0f B/s  %6.2f reads/B  %5.2f writes/B  AVR ~%8.1f B/s\n",
+    len, write ? "write" : "read", block ? "block" : "byte", seconds > 0 ? bytes / seconds : 0,
+    counting::reads / bytes, counting::writes / bytes, bytes / avr_us * 1e6);
+}
+
+int main() {
+  benchfs fs;
+  fs.format();
+  // a single chunk file, and one with continuation extents
+  const uint16_t sizes[] = { 200, 600 };
+  for (byte i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+    byte id = i+1;
+    if (!fs.create(sizes[i], id).is_valid()) {
+      fprintf(stderr, "can't create a %u byte file\n", sizes[i]);
+      return 1;
+    }
+    for (int write=1; write>=0; write--) {
+      measure(fs, id, write, false);
+      measure(fs, id, write, true);
+    }
+  }
+  return 0;
+}
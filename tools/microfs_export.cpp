@@ -0,0 +1,89 @@
+/*
+  microfs_export
+  Decodes a microfs export (see microfs::export_frame()) captured from the serial port, writes the
+  storage image to a file and lists the files it contains.
+
+    g++ -I.. -o microfs_export microfs_export.cpp
+    ./microfs_export eeprom.bin < capture.txt
+
+  Lines that are not part of the export (e.g. debug output) are ignored. If the capture holds
+  more than one export, the last complete one is used. Build with the same MICROFS_FILE_CRC 
+  setting as the sketch, since it changes the on-disk format.
+*/
+
+#include "microfs_host.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+typedef microfs_t<microfs_mmap> hostfs;
+
+// size of the storage announced by the 'S' frame in <line>, 0 if <line> is not an 'S' frame
+static size_t start_size(const std::string& line) {
+  byte frame[MICROFS_FRAME_DATA+5];
+  if (line.size() < 2 || line[0] != ':')
+    return 0;
+  int len = microfs_b64_decode(line.c_str()+1, frame, sizeof(frame));
+  if (len != 6 || frame[0] != 'S')
+    return 0;
+  return (size_t)frame[1] << 16 | (size_t)frame[2] << 8 | frame[3];
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <image> < <capture>\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    while (!line.empty() && (line[line.size()-1] == '\r' || line[line.size()-1] == ' '))
+      line.erase(line.size()-1);
+    size_t start = line.find(':');
+    if (start != std::string::npos)
+      lines.push_back(line.substr(start));
+  }
+
+  size_t size = 0;
+  for (size_t i=0; i<lines.size() && size == 0; i++)
+    size = start_size(lines[i]);
+  if (size == 0 || size > 65536) {
+    fprintf(stderr, "no export found\n");
+    return 1;
+  }
+  if (!microfs_mmap::open(argv[1], size)) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  hostfs fs;
+  bool done = false;
+  unsigned errors = 0;
+  for (size_t i=0; i<lines.size(); i++) {
+    int res = fs.import_frame(lines[i].c_str());
+    if (res > 0)
+      done = true;
+    else if (res < 0)
+      errors++;
+  }
+  if (!done) {
+    fprintf(stderr, "no complete export found (%u bad lines)\n", errors);
+    microfs_mmap::close();
+    return 1;
+  }
+
+  printf("%u bytes, %u used, %u free, %u files\n", (unsigned)size, (unsigned)fs.used(), (unsigned)fs.free(), (unsigned)fs.files());
+  for (int id=1; id<=255; id++) {
+    microfsfile_t<microfs_mmap> f = fs.open(id);
+    if (!f.is_valid())
+      continue;
+    printf("file %3d: %3u bytes at %5u:", id, f.get_size(), (unsigned)f.get_offset());
+    for (int i=0; i<f.get_size(); i++)
+      printf(" %02x", f.read_byte(i));
+    printf("\n");
+  }
+  microfs_mmap::close();
+  return 0;
+}
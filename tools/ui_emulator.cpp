@@ -0,0 +1,208 @@
+/*
+  ui_emulator
+  Runs the screens of display.ino on the host, against an emulated 20x4 HD44780 (see ui_host/)
+  and an emulated keypad matrix scanned by keypad.ino, to replay key sequences, take snapshots of
+  the display and measure the LCD traffic of each screen without the hardware.
+
+    g++ -fpermissive -w -I.. -Iui_host -o ui_emulator ui_emulator.cpp
+    ./ui_emulator < script.txt
+
+  The script holds one command per line, '#' starts a comment:
+
+    keys <keys>            press each of <keys> (0-9, A-D, * and #), UI_EMULATOR_KEY ms apart
+    hold <key> <ms>        hold <key> down for <ms> milliseconds
+    wait <ms>              run the loop for <ms> milliseconds
+    set <input> <value>    set a sensor or output read by the screens: temperature, flame_level,
+                           alarm, ignition, gasvalve or flame
+    snap                   print the display
+    stats                  print the frames drawn and the LCD traffic since the last stats, and
+                           the longest time a pass of loop() spent on the LCD
+
+  e.g. "keys D" then "snap" and "stats" shows the tools screen and what it cost to draw it.
+  Options: -v sends the Serial output to stderr, -a shows custom glyphs in reverse video.
+  The sketch runs on a 1KB RAM file system (formatted at start) and a virtual clock.
+*/
+
+#include <Arduino.h>
+#include <LiquidCrystal.h>
+#include <Time.h>
+
+#include "microfs.h"
+#include "uxmgr.h"
+
+typedef microfs_t<microfs_ram<1024> > microfs;
+typedef microfsfile_t<microfs_ram<1024> > microfsfile;
+
+microfs fs;
+
+// loop() period of the emulated sketch, and of the timer scanning the keypad (ms)
+#define UI_EMULATOR_TICK 10
+// time between two key presses (ms)
+#define UI_EMULATOR_KEY 200
+// how long keys are held down (ms)
+#define UI_EMULATOR_PRESS 60
+
+// what the hardware layer of the sketch reports to the screens, see "set"
+static struct {
+  int temperature;
+  int flame_level;
+  bool alarm, ignition, gasvalve, flame;
+} io = { 20, 0, false, false, false, false };
+
+static byte temperature_target = 0;
+
+int __heap_start, *__brkval;
+
+// the hardware layer, as seen by the screens
+static int8_t get_temperature() { return io.temperature; }
+static byte get_flame_level() { return io.flame_level; }
+static boolean alarm_on() { return io.alarm; }
+static boolean ignition_on() { return io.ignition; }
+static boolean gasvalve_on() { return io.gasvalve; }
+static boolean flame_on() { return io.flame; }
+static byte get_temperature_target() { return temperature_target; }
+static void set_temperature_target(byte target) { temperature_target = target; }
+static void handle_panic() {}
+static void reset() {
+  printf("reset\n");
+  exit(0);
+}
+static byte resume_file_id() { return 0; }
+static int resume_seconds() { return 0; }
+static void resume_save(byte, int) {}
+static void resume_clear() {}
+static void start_fs_export() { Serial.println(F("export started")); }
+
+// the prototypes that the Arduino IDE would generate
+static void setup_display();
+static void update_display();
+static void clear_display();
+static void setup_keypad();
+static char keypad_read();
+static void key_event_push(char key, boolean pressed);
+static void keypad_scan();
+static void poll_keypad();
+
+#include "display.ino"
+#include "keypad.ino"
+#include "uxmgr.cpp"
+
+static char key_down = 0; // key held down on the emulated keypad, 0 if none
+
+// a column of the keypad reads LOW if the key held down connects it to a row driven LOW
+static int read_pin(byte pin) {
+  for (byte r=0; r<rows; r++) {
+    for (byte c=0; c<cols; c++) {
+      if (keys[r][c] == key_down && colPins[c] == pin && 
+          ui_host_pin_mode[rowPins[r]] == OUTPUT && ui_host_pin_level[rowPins[r]] == LOW)
+        return LOW;
+    }
+  }
+  return HIGH;
+}
+
+static unsigned long frames = 0;
+// longest time a pass of loop() spent on the LCD bus (us)
+static unsigned long max_loop_us = 0;
+
+// one pass of loop(), as far as the UI is concerned
+static void tick() {
+  unsigned long us = lcd.stats.us;
+  // the timer
+  keypad_scan();
+  poll_keypad();
+  // same as update_display(), counting the frames
+  if (uxmgr::get().draw())
+    frames++;
+  flush_display();
+  max_loop_us = max(max_loop_us, lcd.stats.us - us);
+  ui_host_clock += UI_EMULATOR_TICK;
+}
+
+static void run(long ms) {
+  for (; ms > 0; ms -= UI_EMULATOR_TICK)
+    tick();
+}
+
+static void print_stats() {
+  lcd_host_stats& s = lcd.stats;
+  printf("%lu frames, %lu commands, %lu data bytes, %lu us", frames, s.commands, s.data, s.us);
+  if (frames > 0)
+    printf(" (%.1f bytes, %.0f us per frame)", (double)(s.commands + s.data) / frames, (double)s.us / frames);
+  printf(", at most %lu us per loop\n", max_loop_us);
+  memset(&s, 0, sizeof(s));
+  frames = 0;
+  max_loop_us = 0;
+}
+
+static bool set_input(const char* name, int value) {
+  if (strcmp(name, "temperature") == 0) io.temperature = value;
+  else if (strcmp(name, "flame_level") == 0) io.flame_level = value;
+  else if (strcmp(name, "alarm") == 0) io.alarm = value;
+  else if (strcmp(name, "ignition") == 0) io.ignition = value;
+  else if (strcmp(name, "gasvalve") == 0) io.gasvalve = value;
+  else if (strcmp(name, "flame") == 0) io.flame = value;
+  else return false;
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool ansi = false;
+  for (int i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-v") == 0) {
+      ui_host_verbose = true;
+    } else if (strcmp(argv[i], "-a") == 0) {
+      ansi = true;
+    } else {
+      fprintf(stderr, "usage: %s [-v] [-a] < <script>\n", argv[0]);
+      return 2;
+    }
+  }
+
+  ui_host_read = read_pin;
+  fs.format();
+  fs.mount();
+  setup_display();
+  setup_keypad();
+  run(UI_EMULATOR_KEY);
+
+  char line[256];
+  unsigned lineno = 0;
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    lineno++;
+    char cmd[16], arg[200];
+    int value;
+    char* comment = strchr(line, '#');
+    // '#' is also a key
+    if (comment != NULL && (comment == line || comment[-1] == ' ' || comment[-1] == '\t') && strncmp(line, "keys", 4) != 0)
+      *comment = '\0';
+    int n = sscanf(line, "%15s %199s %d", cmd, arg, &value);
+    if (n <= 0)
+      continue;
+    if (strcmp(cmd, "keys") == 0 && n >= 2) {
+      for (const char* k = arg; *k; k++) {
+        key_down = *k;
+        run(UI_EMULATOR_PRESS);
+        key_down = 0;
+        run(UI_EMULATOR_KEY - UI_EMULATOR_PRESS);
+      }
+    } else if (strcmp(cmd, "hold") == 0 && n == 3) {
+      key_down = arg[0];
+      run(value);
+      key_down = 0;
+      run(UI_EMULATOR_KEY);
+    } else if (strcmp(cmd, "wait") == 0 && n >= 2) {
+      run(atol(arg));
+    } else if (strcmp(cmd, "set") == 0 && n == 3 && set_input(arg, value)) {
+      // picked up by the next frame
+    } else if (strcmp(cmd, "snap") == 0) {
+      lcd.snapshot(stdout, ansi);
+    } else if (strcmp(cmd, "stats") == 0) {
+      print_stats();
+    } else {
+      fprintf(stderr, "line %u: bad command\n", lineno);
+      return 1;
+    }
+  }
+  return 0;
+}
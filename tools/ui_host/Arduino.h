@@ -0,0 +1,149 @@
+/*
+  The few Arduino core definitions used by the UI layer, so that it builds on the host together
+  with the emulated LiquidCrystal; see tools/ui_emulator.cpp.
+  Time is virtual: millis() returns ui_host_clock, which the emulator advances. The level read
+  on input pins comes from ui_host_read, so that the emulator can model the keypad matrix.
+*/
+
+#ifndef UI_HOST_ARDUINO
+#define UI_HOST_ARDUINO
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(str) (str)
+#define pgm_read_byte(ptr) (*(const byte*)(ptr))
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define _BV(bit) (1 << (bit))
+
+class __FlashStringHelper;
+#define F(str) ((const __FlashStringHelper*)(str))
+
+template <class A, class B> static inline A min(A a, B b) { return a < (A)b ? a : (A)b; }
+template <class A, class B> static inline A max(A a, B b) { return a > (A)b ? a : (A)b; }
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+// the glyphs in custom_chars.h are written with 5 digit binary constants
+#define B00000 0
+#define B00001 1
+#define B00010 2
+#define B00011 3
+#define B00100 4
+#define B00101 5
+#define B00110 6
+#define B00111 7
+#define B01000 8
+#define B01001 9
+#define B01010 10
+#define B01011 11
+#define B01100 12
+#define B01101 13
+#define B01110 14
+#define B01111 15
+#define B10000 16
+#define B10001 17
+#define B10010 18
+#define B10011 19
+#define B10100 20
+#define B10101 21
+#define B10110 22
+#define B10111 23
+#define B11000 24
+#define B11001 25
+#define B11010 26
+#define B11011 27
+#define B11100 28
+#define B11101 29
+#define B11110 30
+#define B11111 31
+
+static unsigned long ui_host_clock = 0;
+
+static inline unsigned long millis() {
+  return ui_host_clock;
+}
+
+static inline unsigned long micros() {
+  return ui_host_clock * 1000;
+}
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define LOW 0
+#define HIGH 1
+
+#define UI_HOST_PINS 20
+
+static byte ui_host_pin_mode[UI_HOST_PINS];
+static byte ui_host_pin_level[UI_HOST_PINS]; // level written on output pins
+static int (*ui_host_read)(byte pin) = NULL;
+
+static inline void pinMode(byte pin, byte mode) {
+  if (pin < UI_HOST_PINS)
+    ui_host_pin_mode[pin] = mode;
+}
+
+static inline void digitalWrite(byte pin, byte level) {
+  if (pin < UI_HOST_PINS)
+    ui_host_pin_level[pin] = level;
+}
+
+static inline int digitalRead(byte pin) {
+  return ui_host_read != NULL ? ui_host_read(pin) : HIGH;
+}
+
+// Serial output goes to stderr when ui_host_verbose is set, and is discarded otherwise
+static bool ui_host_verbose = false;
+
+class HardwareSerial {
+  void out(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+  public:
+  void begin(unsigned long) {}
+  int available() { return 0; }
+  int availableForWrite() { return 64; }
+  int read() { return -1; }
+  void print(const __FlashStringHelper* s) { out("%s", (const char*)s); }
+  void print(const char* s) { out("%s", s); }
+  void print(char c) { out("%c", c); }
+  void print(signed char n) { out("%d", n); }
+  void print(unsigned char n) { out("%u", n); }
+  void print(short n) { out("%d", n); }
+  void print(unsigned short n) { out("%u", n); }
+  void print(int n) { out("%d", n); }
+  void print(unsigned n) { out("%u", n); }
+  void print(long n) { out("%ld", n); }
+  void print(unsigned long n) { out("%lu", n); }
+  template <class T> void println(T v) { print(v); println(); }
+  void println() { out("\n"); }
+};
+
+#include <stdarg.h>
+
+inline void HardwareSerial::out(const char* fmt, ...) {
+  if (!ui_host_verbose)
+    return;
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+}
+
+static HardwareSerial Serial;
+
+#endif // UI_HOST_ARDUINO
@@ -0,0 +1,157 @@
+/*
+  A 20x4 HD44780 driven in 4 bit mode by the LiquidCrystal library, modelled on the host: the
+  DDRAM, the CGRAM, the address counter and the time the library spends on the bus.
+  See tools/ui_emulator.cpp.
+*/
+
+#ifndef UI_HOST_LIQUIDCRYSTAL
+#define UI_HOST_LIQUIDCRYSTAL
+
+#include "Arduino.h"
+
+// LiquidCrystal sends a byte as two nibbles and waits ~100us after each of them
+#define LCD_HOST_BYTE_US 204
+// clear() and home() wait 2ms more
+#define LCD_HOST_CLEAR_US 2000
+
+// bus traffic since the counters were last reset
+struct lcd_host_stats {
+  unsigned long commands; // instruction bytes (setCursor(), createChar(), ...)
+  unsigned long data; // data bytes (characters and glyph rows)
+  unsigned long us; // time spent on the bus
+};
+
+class LiquidCrystal {
+  byte ddram[0x80];
+  byte cgram[0x40];
+  byte addr; // address counter
+  bool cg; // the address counter points in CGRAM
+  byte cols, rows;
+  
+  void command(unsigned long us=0) {
+    stats.commands++;
+    stats.us += LCD_HOST_BYTE_US + us;
+  }
+  
+  public:
+  lcd_host_stats stats;
+  
+  LiquidCrystal(byte, byte, byte, byte, byte, byte) : addr(0), cg(false), cols(16), rows(1) {
+    memset(ddram, ' ', sizeof(ddram));
+    memset(cgram, 0, sizeof(cgram));
+    memset(&stats, 0, sizeof(stats));
+  }
+  
+  void begin(byte c, byte r) {
+    cols = c;
+    rows = r;
+    clear();
+  }
+  
+  void clear() {
+    memset(ddram, ' ', sizeof(ddram));
+    addr = 0;
+    cg = false;
+    command(LCD_HOST_CLEAR_US);
+  }
+  
+  void home() {
+    addr = 0;
+    cg = false;
+    command(LCD_HOST_CLEAR_US);
+  }
+  
+  void setCursor(byte col, byte row) {
+    static const byte offsets[] = { 0x00, 0x40, 0x14, 0x54 };
+    addr = (offsets[row & 3] + col) & 0x7f;
+    cg = false;
+    command();
+  }
+  
+  void createChar(byte location, byte charmap[]) {
+    addr = (location & 7) << 3;
+    cg = true;
+    command();
+    for (byte i=0; i<8; i++)
+      write(charmap[i]);
+  }
+  
+  size_t write(byte value) {
+    if (cg) {
+      cgram[addr & 0x3f] = value & 0x1f;
+      addr = (addr + 1) & 0x3f;
+    } else {
+      ddram[addr] = value;
+      addr = (addr + 1) & 0x7f;
+    }
+    stats.data++;
+    stats.us += LCD_HOST_BYTE_US;
+    return 1;
+  }
+  
+  size_t print(const char* str) {
+    size_t n = 0;
+    while (*str)
+      n += write(*str++);
+    return n;
+  }
+  
+  void noBlink() { command(); }
+  void blink() { command(); }
+  void noCursor() { command(); }
+  void cursor() { command(); }
+  void noAutoscroll() { command(); }
+  void autoscroll() { command(); }
+  void noDisplay() { command(); }
+  void display() { command(); }
+  
+  // character code shown at col, row
+  byte at(byte col, byte row) const {
+    static const byte offsets[] = { 0x00, 0x40, 0x14, 0x54 };
+    return ddram[(offsets[row & 3] + col) & 0x7f];
+  }
+  
+  // row <r> of glyph <code> (0-15, 8-15 mirror 0-7)
+  byte glyph_row(byte code, byte r) const {
+    return cgram[(code & 7) << 3 | (r & 7)];
+  }
+  
+  // write what the display shows to <out>, one framed line per row; characters outside of ASCII
+  // are shown as their closest ASCII equivalent and custom glyphs as '0'-'7' in reverse video
+  // when <ansi> is set, as '#' otherwise
+  void snapshot(FILE* out, bool ansi=false) const {
+    fprintf(out, "+");
+    for (byte c=0; c<cols; c++)
+      fputc('-', out);
+    fprintf(out, "+\n");
+    for (byte r=0; r<rows; r++) {
+      fputc('|', out);
+      for (byte c=0; c<cols; c++) {
+        byte ch = at(c, r);
+        if (ch < 16) {
+          if (ansi)
+            fprintf(out, "\x1b[7m%c\x1b[0m", '0' + (ch & 7));
+          else
+            fputc('#', out);
+        } else if (ch == 0x7e) {
+          fputc('>', out);
+        } else if (ch == 0x7f) {
+          fputc('<', out);
+        } else if (ch == 0xdf) {
+          fputc('\'', out);
+        } else if (ch < 0x20 || ch > 0x7d) {
+          fputc('?', out);
+        } else {
+          fputc(ch, out);
+        }
+      }
+      fprintf(out, "|\n");
+    }
+    fprintf(out, "+");
+    for (byte c=0; c<cols; c++)
+      fputc('-', out);
+    fprintf(out, "+\n");
+  }
+};
+
+#endif // UI_HOST_LIQUIDCRYSTAL
@@ -0,0 +1,7 @@
+#include <time.h>
+
+#include "Arduino.h"
+
+static inline time_t now() {
+  return millis() / 1000;
+}
@@ -2,3 +2,13 @@
 
 uxmgr uxmgr::singleton = uxmgr();
 
+
+#if UXMGR_STATS && defined(__AVR__)
+// fill the RAM between the variables and the stack with UX_STACK_PAINT; runs before main(), once
+// the stack pointer is set up, and falls through to the rest of the startup code
+__attribute__((naked, used, section(".init3"))) static void ux_stack_paint() {
+  extern char *__bss_end;
+  for (byte *p = (byte*)&__bss_end; p < (byte*)SP; p++)
+    *p = UX_STACK_PAINT;
+}
+#endif
@@ -2,32 +2,291 @@
 #define UXMGR
 
 #include <stddef.h>
+#include <Arduino.h>
 #include <HardwareSerial.h>
 
-#define __string_PGM(data)                  \
-  char __buf__[sizeof(data)];               \
-  strcpy_P(__buf__, PSTR(data));             
+// transition::pop value that removes every screen
+#define UXMGR_POP_ALL 255
+
+// a key held down this long (ms) is a long press, see ux::on_long_key()
+#ifndef UXMGR_LONG_PRESS_MS
+#define UXMGR_LONG_PRESS_MS 800
+#endif
+
+// a key that repeats (see ux::repeats()) does so after being held this long (ms)...
+#ifndef UXMGR_REPEAT_DELAY_MS
+#define UXMGR_REPEAT_DELAY_MS 500
+#endif
+
+// ...and then every UXMGR_REPEAT_MS
+#ifndef UXMGR_REPEAT_MS
+#define UXMGR_REPEAT_MS 100
+#endif
+
+// minimum time between two frames (ms), caps the frame rate
+#ifndef UXMGR_FRAME_MS
+#define UXMGR_FRAME_MS 50
+#endif
+
+// 1 to time the screens and loop() and to measure the stack, see ux_stats; costs ~250 bytes of RAM
+#ifndef UXMGR_STATS
+#define UXMGR_STATS 0
+#endif
+
+// sections of loop() timed with UXMGR_TIME()
+#ifndef UXMGR_STATS_SLOTS
+#define UXMGR_STATS_SLOTS 8
+#endif
+
+// loop() periods are counted in buckets of 0, 1, 2-3, 4-7... ms, the last one takes the rest
+#define UXMGR_STATS_BUCKETS 8
 
 extern HardwareSerial Serial;
 
+// screens are allocated from this arena instead of the heap, see UX_ARENA()
+extern byte ux_arena[];
+extern const size_t ux_arena_size;
+
+// alignment of the screens in the arena
+#define UX_ALIGN __BIGGEST_ALIGNMENT__
+
+// bytes taken in the arena by screens of types T... all shown at the same time
+template <class... T> struct ux_sizeof {
+  enum { value = 0 };
+};
+
+template <class T, class... R> struct ux_sizeof<T, R...> {
+  enum { value = (sizeof(T) + UX_ALIGN-1) / UX_ALIGN * UX_ALIGN + ux_sizeof<R...>::value };
+};
+
+// define the arena, large enough for all of the screen types listed to be on the stack at once;
+// to be used once, after the screens have been defined
+#define UX_ARENA(...)                                                                     \
+  byte ux_arena[ux_sizeof<__VA_ARGS__>::value] __attribute__((aligned(UX_ALIGN)));       \
+  UX_STATS_TYPES(__VA_ARGS__)                                                             \
+  extern const size_t ux_arena_size = sizeof(ux_arena)
+
+#if UXMGR_STATS
+
+// index of T in the types L..., the number of types if it is not one of them
+template <class T, class... L> struct ux_index_of {
+  enum { value = 0 };
+};
+
+template <class T, class H, class... R> struct ux_index_of<T, H, R...> {
+  enum { value = 1 + ux_index_of<T, R...>::value };
+};
+
+template <class T, class... R> struct ux_index_of<T, T, R...> {
+  enum { value = 0 };
+};
+
+// min/avg/max of a duration, in us; durations over 65535us count as 65535us
+struct ux_timing {
+  uint16_t min, max;
+  uint32_t total;
+  uint16_t count;
+  
+  void add(unsigned long us) {
+    uint16_t t = us < 0xffff ? us : 0xffff;
+    if (count == 0 || t < min)
+      min = t;
+    if (t > max)
+      max = t;
+    if (count == 0xffff) {
+      // halve both so that the average stays right
+      total /= 2;
+      count /= 2;
+    }
+    total += t;
+    count++;
+  }
+  
+  uint16_t avg() const {
+    return count != 0 ? total / count : 0;
+  }
+  
+  void print() const {
+    Serial.print(min);
+    Serial.print(' ');
+    Serial.print(avg());
+    Serial.print(' ');
+    Serial.print(max);
+    Serial.print(' ');
+    Serial.println(count);
+  }
+};
+
+// the screen types given to UX_ARENA(), their names ("splash_screen, main_menu, ...") and the
+// time their draw() takes, by index in the list
+template <class T> byte ux_type_index();
+extern const char ux_type_names[] PROGMEM;
+extern ux_timing ux_draw_stats[];
+extern const byte ux_types;
+
+#define UX_STATS_TYPES(...)                                                               \
+  template <class T> byte ux_type_index() { return ux_index_of<T, __VA_ARGS__>::value; } \
+  extern const char ux_type_names[] PROGMEM = #__VA_ARGS__;                              \
+  ux_timing ux_draw_stats[ux_index_of<void, __VA_ARGS__>::value];                        \
+  extern const byte ux_types = ux_index_of<void, __VA_ARGS__>::value;
+
+// name of the screen type <index> in ux_type_names, up to the next ','
+static PGM_P ux_type_name(byte index) {
+  PGM_P name = ux_type_names;
+  while (index > 0) {
+    char c = pgm_read_byte(name++);
+    if (c == ',')
+      index--;
+    else if (c == '\0')
+      return name-1;
+  }
+  while (pgm_read_byte(name) == ' ')
+    name++;
+  return name;
+}
+
+// the free RAM is filled with this at reset, see ux_stack_paint() in uxmgr.cpp
+#define UX_STACK_PAINT 0xc5
+
+#ifdef __AVR__
+// bytes between the heap and the deepest the stack has been since reset
+static unsigned ux_stack_unused() {
+  extern char *__bss_end;
+  extern int *__brkval;
+  byte *p = __brkval != 0 ? (byte*)__brkval : (byte*)&__bss_end;
+  unsigned unused = 0;
+  while (p + unused < (byte*)SP && p[unused] == UX_STACK_PAINT)
+    unused++;
+  return unused;
+}
+#else
+static unsigned ux_stack_unused() {
+  return 0;
+}
+#endif
+
+// timings collected by uxmgr and by UXMGR_LOOP() and UXMGR_TIME() in loop()
+struct ux_stats {
+  ux_timing loops; // period of loop()
+  uint16_t loop_buckets[UXMGR_STATS_BUCKETS];
+  unsigned long last_loop; // micros() when loop() last started
+  ux_timing slots[UXMGR_STATS_SLOTS];
+  const __FlashStringHelper* slot_names[UXMGR_STATS_SLOTS];
+  
+  void loop_start() {
+    unsigned long now = micros();
+    if (last_loop != 0) {
+      unsigned long ms = (now - last_loop) / 1000;
+      loops.add(now - last_loop);
+      byte bucket = 0;
+      for (; ms != 0 && bucket < UXMGR_STATS_BUCKETS-1; bucket++)
+        ms >>= 1;
+      if (loop_buckets[bucket] != 0xffff)
+        loop_buckets[bucket]++;
+    }
+    last_loop = now;
+  }
+  
+  void time(byte slot, const __FlashStringHelper* name, unsigned long us) {
+    slots[slot].add(us);
+    slot_names[slot] = name;
+  }
+  
+  // the screen type whose draw() took the longest
+  byte slowest_screen() const {
+    byte slowest = 0;
+    for (byte i=1; i<ux_types; i++)
+      if (ux_draw_stats[i].max > ux_draw_stats[slowest].max)
+        slowest = i;
+    return slowest;
+  }
+  
+  // the section of loop() that took the longest
+  byte slowest_slot() const {
+    byte slowest = 0;
+    for (byte i=1; i<UXMGR_STATS_SLOTS; i++)
+      if (slots[i].max > slots[slowest].max)
+        slowest = i;
+    return slowest;
+  }
+  
+  // send everything over Serial, one line per timing: name min avg max count (us)
+  void print() const {
+    Serial.print(F("stack unused "));
+    Serial.println(ux_stack_unused());
+    Serial.print(F("loop "));
+    loops.print();
+    for (byte i=0; i<UXMGR_STATS_BUCKETS; i++) {
+      Serial.print(i < UXMGR_STATS_BUCKETS-1 ? F("loop <") : F("loop >="));
+      Serial.print(i < UXMGR_STATS_BUCKETS-1 ? 1u << i : 1u << (i-1));
+      Serial.print(F("ms "));
+      Serial.println(loop_buckets[i]);
+    }
+    for (byte i=0; i<UXMGR_STATS_SLOTS; i++) {
+      if (slot_names[i] == NULL)
+        continue;
+      Serial.print(slot_names[i]);
+      Serial.print(' ');
+      slots[i].print();
+    }
+    for (byte i=0; i<ux_types; i++) {
+      Serial.print(F("draw "));
+      for (PGM_P name = ux_type_name(i); pgm_read_byte(name) != ',' && pgm_read_byte(name) != '\0'; name++)
+        Serial.print((char)pgm_read_byte(name));
+      Serial.print(' ');
+      ux_draw_stats[i].print();
+    }
+  }
+};
+
+// to be called first thing in loop()
+#define UXMGR_LOOP() uxmgr::get().stats.loop_start()
+
+// run <statement>, adding the time it took to the timing <slot> of the stats, named <name>
+#define UXMGR_TIME(slot, name, statement) {                   \
+  unsigned long __start = micros();                           \
+  statement;                                                  \
+  uxmgr::get().stats.time(slot, F(name), micros() - __start); \
+}
+
+#else
+
+#define UX_STATS_TYPES(...)
+#define UXMGR_LOOP()
+#define UXMGR_TIME(slot, name, statement) { statement; }
+
+#endif // UXMGR_STATS
+
 class ux {
   friend class uxmgr;
   protected:
   ux *prev;
+#if UXMGR_STATS
+  byte type; // index in UX_ARENA(), see ux_draw_stats
+#endif
   ux() : prev(NULL) {}
   virtual ~ux() { delete prev; prev = NULL; }
+  static void* operator new(size_t size);
+  static void operator delete(void* ptr);
   template <class T> void show();
   template <class T> void show(int param);
   template <class T> void next();
   template <class T> void next(int param);
   void back();
   void back(int retVal);
+  void invalidate();
   public:
   virtual void on_init(int param) {};
   virtual void on_show() {};
   virtual void draw() = 0;
   virtual void on_key(char key) { back(); }
+  // called once when <key> is held down for UXMGR_LONG_PRESS_MS, unless it repeats
+  virtual void on_long_key(char key) {};
+  // keys for which on_key() is called again and again while they are held down
+  virtual bool repeats(char key) { return false; }
   virtual void on_back(int retVal) {};
+  // redraw at least every refresh_period() ms, 0 to redraw only when invalidated
+  virtual unsigned refresh_period() { return 0; }
 };
 
 template <unsigned max, unsigned delta=max, unsigned min=0>
@@ -71,12 +330,128 @@ class uxmgr {
   static uxmgr singleton;
 
   ux *curr;
+  bool dirty;
+  unsigned long last_draw;
+  byte *arena_top; // first free byte of the arena
+  
+  // a screen to push
+  struct screen_request {
+    ux* (*create)(); // creates the screen, NULL if none
+    bool init; // call on_init(param) on it
+    int param;
+  };
+  
+  // the transition requested by the screens, applied once the callback requesting it returns so
+  // that no screen is deleted while one of its methods is running; the requests made by a
+  // callback add up, e.g. back() then next<T>() replaces the current screen with a T, and
+  // show<T>() then next<U>() leaves a U on top of a T
+  struct transition {
+    byte pop; // screens to pop, UXMGR_POP_ALL to empty the stack
+    screen_request root; // pushed on the emptied stack, with pop == UXMGR_POP_ALL
+    screen_request push; // pushed on top
+    bool with_ret_val; // call on_back(ret_val) on the screen uncovered by pop
+    int ret_val;
+  } pending;
+  bool busy; // a callback or a transition is running
+  
+  char held; // key held down, 0 if none or if it was pressed on another screen
+  uint16_t held_since; // when it was pressed
+  uint16_t next_repeat; // when it repeats next
+  bool long_pressed; // on_long_key() was called for it
 
   uxmgr() {
     curr = NULL;
+    dirty = true;
+    last_draw = 0;
+    arena_top = ux_arena;
+    memset(&pending, 0, sizeof(pending));
+    busy = false;
+    held = 0;
+#if UXMGR_STATS
+    memset(&stats, 0, sizeof(stats));
+#endif
+  }
+  
+  template <class T>
+  static ux* create() {
+    ux *screen = new T();
+#if UXMGR_STATS
+    screen->type = ux_type_index<T>();
+#endif
+    return screen;
+  }
+  
+  void request(byte pop, ux* (*create)(), bool init, int param) {
+    screen_request screen = { create, init, param };
+    if (pop == UXMGR_POP_ALL) {
+      // the screens requested before are dropped along with the stack
+      pending.pop = UXMGR_POP_ALL;
+      pending.root = screen;
+      pending.push.create = NULL;
+    } else if (pending.push.create != NULL) {
+      // only one screen can be pushed on top, the first one requested stays
+      Serial.println(F("ux screen already requested"));
+      return;
+    } else {
+      pending.push = screen;
+    }
+    apply();
+  }
+  
+  // push the screen <screen> on top of the stack
+  void push(const screen_request& screen) {
+    ux *prev = curr;
+    curr = screen.create();
+    curr->prev = prev;
+    if (screen.init)
+      curr->on_init(screen.param);
+  }
+  
+  // apply the pending transition, and those requested by the callbacks it runs; the screens
+  // popped on the way and the screens replaced before being shown never get on_show()
+  void apply() {
+    if (busy)
+      return;
+    busy = true;
+    while (pending.pop != 0 || pending.push.create != NULL) {
+      transition t = pending;
+      memset(&pending, 0, sizeof(pending));
+      dump(F("apply"), true);
+      bool moved = false;
+      if (t.pop == UXMGR_POP_ALL) {
+        delete curr;
+        curr = NULL;
+        moved = true;
+      }
+      for (; t.pop > 0 && t.pop != UXMGR_POP_ALL && curr->prev != NULL; t.pop--) {
+        ux *prev = curr->prev;
+        curr->prev = NULL;
+        delete curr;
+        curr = prev;
+        moved = true;
+      }
+      if (t.root.create != NULL) {
+        push(t.root);
+        moved = true;
+      }
+      if (t.push.create != NULL) {
+        push(t.push);
+        moved = true;
+      } else if (t.root.create == NULL && moved && t.with_ret_val) {
+        curr->on_back(t.ret_val);
+      }
+      if (moved) {
+        // a key held down does not repeat on the new screen
+        held = 0;
+        curr->on_show();
+        dirty = true;
+      }
+      dump(F("apply"), false);
+    }
+    busy = false;
   }
   
-  void dump(const char* prefix, bool in) {
+  void dump(const __FlashStringHelper* prefix, bool in) {
     Serial.print(in ? '>' : '<');
     if (prefix != NULL) {
       Serial.print(prefix);
@@ -93,69 +468,162 @@ class uxmgr {
   
   public:
   
+#if UXMGR_STATS
+  ux_stats stats;
+#endif
+  
   static uxmgr& get() {
     return singleton;
   }
   
-  template <class T>
-  void show(ux *prev = NULL) {
-    __string_PGM("show");
-    dump(__buf__, true);
-    if (prev == NULL)
-      delete curr;
-    curr = new T();
-    curr->prev = prev;
-    dump(__buf__, false);
-    curr->on_show();
+  // screens are pushed and popped like a stack, so the arena is a stack as well
+  void* alloc(size_t size) {
+    size = (size + UX_ALIGN-1) / UX_ALIGN * UX_ALIGN;
+    if (size > (size_t)(ux_arena + ux_arena_size - arena_top)) {
+      // a screen missing from UX_ARENA(), or shown twice
+      Serial.println(F("ux arena full"));
+      return malloc(size);
+    }
+    void *ptr = arena_top;
+    arena_top += size;
+    return ptr;
+  }
+  
+  // releasing a screen also releases the screens allocated after it
+  void release(void* ptr) {
+    if (ptr < ux_arena || ptr >= ux_arena + ux_arena_size)
+      free(ptr);
+    else if (ptr < arena_top)
+      arena_top = (byte*)ptr;
   }
   
   template <class T>
-  void show(ux *prev, int param) {
-    show<T>(prev);
-    curr->on_init(param);
+  void show() {
+    request(UXMGR_POP_ALL, &create<T>, false, 0);
   }
   
   template <class T>
   void show(int param) {
-    show<T>(NULL, param);
+    request(UXMGR_POP_ALL, &create<T>, true, param);
   }
   
   template <class T>
   void next() {
-    show<T>(curr);
+    request(0, &create<T>, false, 0);
   }
 
   template <class T>
   void next(int param) {
-    show<T>(curr, param);
+    request(0, &create<T>, true, param);
   }
 
   void back(int retVal=0, bool withRetVal=false) {
-    __string_PGM("back");
-    dump(__buf__, true);
-    ux *prev = curr->prev;
-    if (prev != NULL) {
-      curr->prev = NULL;
-      delete curr;
-      curr = prev;
-      if (withRetVal) {
-        curr->on_back(retVal);
-      }
-      curr->on_show();
+    if (pending.push.create != NULL) {
+      // the screen requested by this callback is dropped before being created
+      pending.push.create = NULL;
+    } else if (pending.pop == UXMGR_POP_ALL) {
+      // the new root screen has nothing to go back to
+      return;
+    } else {
+      pending.pop++;
     }
-    dump(__buf__, false);
+    pending.ret_val = retVal;
+    pending.with_ret_val = withRetVal;
+    apply();
   }
   
-  void draw() {
+  // the transitions requested until commit() are applied together, as if requested by a
+  // callback: for use outside of the callbacks, e.g. show<T>() then next<U>() in setup()
+  void defer() {
+    busy = true;
+  }
+  
+  void commit() {
+    busy = false;
+    apply();
+  }
+  
+  void invalidate() {
+    dirty = true;
+  }
+  
+  // draw the current screen if it was invalidated or its refresh period expired
+  // returns false if the frame was skipped
+  bool draw() {
+    unsigned long now = millis();
+    if (now - last_draw < UXMGR_FRAME_MS)
+      return false;
+    unsigned period = curr->refresh_period();
+    if (!dirty && (period == 0 || now - last_draw < period))
+      return false;
+    dirty = false;
+    last_draw = now;
+    busy = true;
+#if UXMGR_STATS
+    unsigned long start = micros();
+    curr->draw();
+    if (curr->type < ux_types)
+      ux_draw_stats[curr->type].add(micros() - start);
+#else
     curr->draw();
+#endif
+    busy = false;
+    apply();
+    return true;
+  }
+  
+  // a key was pressed or released at <time> (millis())
+  void on_key_event(char key, bool pressed, uint16_t time) {
+    if (!pressed) {
+      if (key == held)
+        held = 0;
+      return;
+    }
+    held = key;
+    held_since = time;
+    next_repeat = time + UXMGR_REPEAT_DELAY_MS;
+    long_pressed = false;
+    on_key(key);
+  }
+  
+  // repeat the key held down, or report it as a long press, when it is time to
+  void poll_keys(uint16_t now) {
+    if (held == 0)
+      return;
+    if (curr->repeats(held)) {
+      if ((int16_t)(now - next_repeat) < 0)
+        return;
+      // never repeat more than once per call, even if loop() was held up
+      next_repeat = now + UXMGR_REPEAT_MS;
+      on_key(held);
+    } else if (!long_pressed && (uint16_t)(now - held_since) >= UXMGR_LONG_PRESS_MS) {
+      long_pressed = true;
+      busy = true;
+      curr->on_long_key(held);
+      busy = false;
+      apply();
+    }
   }
   
   void on_key(char key) {
+    // most keys change what the screen shows
+    dirty = true;
+    busy = true;
     curr->on_key(key);
+    busy = false;
+    apply();
   }
   
 };
 
+inline void* ux::operator new(size_t size) {
+  return uxmgr::get().alloc(size);
+}
+
+inline void ux::operator delete(void* ptr) {
+  uxmgr::get().release(ptr);
+}
+
 inline void ux::back() { 
   uxmgr::get().back(); 
 }
@@ -164,6 +632,10 @@ inline void ux::back(int retVal) {
   uxmgr::get().back(retVal, true);
 }
 
+inline void ux::invalidate() {
+  uxmgr::get().invalidate();
+}
+
 template <class T> void ux::show() {
   uxmgr::get().show<T>();
 }
@@ -173,11 +645,11 @@ template <class T> void ux::show(int param) {
 }
 
 template <class T> void ux::next() {
-  uxmgr::get().show<T>(this);
+  uxmgr::get().next<T>();
 }
 
 template <class T> void ux::next(int param) {
-  uxmgr::get().show<T>(this, param);
+  uxmgr::get().next<T>(param);
 }
 
 #endif // UXMGR